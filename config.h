@@ -22,6 +22,12 @@ static struct Config config = {
 	/* history */
 	.histsize = 100,        /* history size */
 
+	/* threads for parsing input and matching items (0 for one per processor) */
+	.nthreads = 0,
+
+	/* bytes of the lists of matching items kept for inputs that come back */
+	.matchcache = 64 * 1024 * 1024,
+
 	/* if nonzero, indent items on dropdown menu (as in dmenu) */
 	.indent = 0
 };
@@ -1,6 +1,18 @@
 /* See LICENSE file for copyright and license details. */
 
+#define _GNU_SOURCE     /* for mkostemp() with glibc */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define X86SIMD         /* substring search with sse2 and avx2, picked at run time */
+#endif
 #include <ctype.h>
 #include <dirent.h>
 #include <err.h>
@@ -9,6 +21,9 @@
 #include <limits.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,10 +40,30 @@
 #define CLASS        "XFilter"
 #define TITLE        "xfilter"
 #define INPUTSIZ     1024
+#define READSIZ      (64 * 1024) /* size of each read from stdin */
+#define SPOOLSIZ     (4 * 1024 * 1024) /* size of each chunk of spooled input */
+#define PARSESIZ     (1024 * 1024) /* bytes of mapped input parsed by each thread at a time */
+#define BLOCKSIZ     4096       /* size of the first block of an arena */
+#define MAXBLOCKSIZ  (1024 * 1024) /* size blocks of an arena stop doubling at */
+#define CODESIZ      4096       /* size of the blocks front-coded lines are written into */
+#define VARINTSIZ    10         /* most bytes a length is written into by putvarint() */
+#define FILTERSIZ    256        /* size of the filter of the pairs of bytes in a block of front-coded lines */
+#define CACHEMAGIC   "xfilter\1" /* first bytes of a complete image of the items of a file */
+#define CACHEALIGN(n) (((n) + 7) & ~(uint64_t)7) /* size of a section of an image, padded to 8 bytes */
+#define WATCHDELAY   100        /* time in miliseconds a watched file must be left alone before reloading it */
+#define RERUNDELAY   150        /* time in miliseconds the input must be left alone before running the command again */
 #define DEFWIDTH     600        /* default width */
 #define DEFHEIGHT    20         /* default height for each text line */
 #define DOUBLECLICK  250        /* time in miliseconds of a double click */
 #define GROUPWIDTH   150        /* width of space for group name */
+#define NOITEM       SIZE_MAX   /* position of no item in the list of matching items */
+#define MATCHPREFIX  0x80       /* set in the match of an item that matched at a word boundary */
+#define MATCHNEW     0x7F       /* match of an item not matched against the input yet */
+#define MATCHSIZ     16384      /* number of items each thread matches against the input at a time */
+#define RANKSIZ      256        /* number of items ranked at first with -z, more are ranked as the list is scrolled */
+#define INDEXSIZ     16384      /* number of items indexed at a time with -t, when there is nothing else to do */
+#define MERGESIZ     65536      /* number of word boundaries merged at a time with -t, when there is nothing else to do */
+#define SCANRATIO    8          /* with -t, items are matched rather than looked up if more than one in this many may match */
 
 #define LEN(x) (sizeof (x) / sizeof (x[0]))
 #define MAX(x,y) ((x)>(y)?(x):(y))
@@ -46,6 +81,16 @@
 enum {ColorFG, ColorBG, ColorCM, ColorLast};
 enum {LowerCase, UpperCase, CaseLast};
 enum Press_ret {DrawPrompt, DrawInput, Esc, Enter, Nop};
+enum Field {FieldText, FieldDescription, FieldOutput, FieldLast};
+
+/* classes of matching items, listed in this order */
+enum Class {
+	ClassPrefix,            /* items that match at a word boundary */
+	ClassFilePrefix,        /* file completion items that match at a word boundary */
+	ClassMiddle,            /* items that only match in the middle of a word */
+	ClassFileMiddle,        /* file completion items that only match in the middle of a word */
+	ClassLast
+};
 
 /* atoms */
 enum {
@@ -117,6 +162,10 @@ struct Config {
 	const char *histfile;
 	size_t histsize;
 
+	unsigned nthreads;
+
+	size_t matchcache;
+
 	int indent;
 };
 
@@ -146,14 +195,248 @@ struct IC {
 	int composing;              /* whether user is composing text */
 };
 
-/* completion items */
+/* block of memory of an arena */
+struct Block {
+	struct Block *next;
+	size_t size;                            /* size of the block, including this header */
+};
+
+/* memory that groups and file names are allocated from, and freed all at once */
+struct Arena {
+	struct Block *blocks;                   /* list of blocks, the one allocated from first */
+	struct Block *last;                     /* oldest block */
+	char *pos, *end;                        /* free space of the first block */
+	size_t size;                            /* size of the next block */
+	size_t total;                           /* size of all the blocks */
+};
+
+/* items whose text is in the same buffer */
+struct Run {
+	size_t first;                           /* index of the first item of the run */
+	const char *base;                       /* address the text of the items is an offset from */
+	int coded;                              /* whether base is a block of front-coded lines */
+};
+
+/*
+ * lines written into blocks with -P, each line as the length of the
+ * prefix it shares with the line before it, the length of the rest of
+ * it, and the rest of it; the first line of a block shares nothing,
+ * so a block is decoded from its beginning.  A block begins with a
+ * bloom filter of the pairs of adjacent bytes of its lines, so the
+ * blocks that cannot match the input are not decoded.
+ */
+struct Coder {
+	char *block;                            /* block being written */
+	size_t pos, size;                       /* bytes written into the block, and its size */
+	char *prev;                             /* last line written */
+	size_t prevlen, prevsize;
+};
+
+/* line decoded from a block of front-coded lines */
+struct Decoder {
+	const char *block;                      /* block being decoded */
+	const char *line;                       /* line decoded last */
+	const char *next;                       /* line after it */
+	char *buf;                              /* contents of the line decoded last, followed by a nul */
+	size_t size;
+};
+
+/*
+ * completion items, in arrays indexed by item; the text of an item
+ * is not nul-terminated, it points into the input and is followed by
+ * a tab, a newline or a nul.  The description and the output follow
+ * the text after tabs, so they are found from it when needed.
+ */
+struct Table {
+	uint32_t *off;                          /* offset of the text from the base of its run */
+	uint32_t *len;                          /* length of the text */
+	uint32_t *group;                        /* item group, 0 for none; NULL if items are not grouped */
+	unsigned char *match;                   /* field that matched the input, or'ed with MATCHPREFIX */
+	size_t nitems, size;                    /* number of items, and of items there is room for */
+	struct Run *runs;                       /* runs of items, in order */
+	size_t nruns, runsize;
+	struct Group **groups;                  /* groups of the items, group n is groups[n - 1] */
+	size_t ngroups, groupsize;
+	uint32_t *names;                        /* hash table of the group numbers by name, 0 for free slots */
+	size_t namesize;                        /* number of slots, a power of two */
+	struct Decoder dec;                     /* line of the table decoded last */
+};
+
+/* indices of the items of a class that match the input, in order */
+struct Matches {
+	uint32_t *items;
+	size_t n, size;
+};
+
+/* item ranked by how well it matches the input, with -z */
+struct Rank {
+	uint32_t i;                     /* index of the item in the table of its class */
+	enum Class class;
+	int score;                      /* the higher, the better */
+};
+
+/* items matched against the input by one thread, split from the others to be matched in parallel */
+struct Slice {
+	struct Matches prefix;          /* the ones that matched at a word boundary, in order */
+	struct Matches middle;          /* the ones that only matched in the middle of a word, in order */
+};
+
+/* items being matched against the input by the event loop and the matching threads, a slice at a time */
+struct Job {
+	struct Table *table;
+	const uint32_t *items;          /* items to match, NULL for the items from first on */
+	size_t first, n;
+	const char *text;               /* input the items are matched against */
+	size_t len;
+	struct Slice *slices;           /* results of the slices, kept from job to job */
+	size_t nslices, slicesize;
+	size_t next;                    /* slice to be matched next */
+	size_t done;                    /* number of slices matched */
+	size_t gen;                     /* incremented for each job */
+	int middle;                     /* whether the items are only matched in the middle of words */
+	int cancel;                     /* set when the input the items are matched against is dropped */
+	int quit;                       /* set to stop the matching threads */
+};
+
+/* list of the items that matched an input, kept for when the input comes back */
+struct Memo {
+	struct Memo *next;              /* next memo, less recently used */
+	char *text;                     /* input the items matched */
+	uint32_t *items;                /* items matching at a word boundary, then the others */
+	unsigned char *match;           /* how each of them matched */
+	size_t nprefix, nmiddle;
+	size_t nitems, gen;             /* number and generation of the items when they were matched */
+	enum Class selclass, listclass; /* selected item and first listed item */
+	size_t selid, listid;           /* NOITEM for none */
+	size_t size;                    /* bytes taken by the memo */
+};
+
+/* items whose matched fields contain a trigram, with -t */
+struct Posting {
+	uint32_t key;                   /* the three bytes, lowercased with -i, plus 1 << 24; 0 for a free slot */
+	uint32_t n, size;
+	uint32_t *items;                /* in order */
+};
+
+/* word boundary of a field of an item, where the field is matched at one, with -t */
+struct Boundary {
+	const char *s;                  /* bytes of the field from the boundary on */
+	uint32_t len;                   /* number of them */
+	uint32_t item;
+};
+
+/* trigram and word boundary index of the items, built a step at a time when there is nothing else to do */
+struct Index {
+	struct Posting *slots;          /* hash table of the postings by trigram */
+	size_t nslots, nkeys;           /* number of slots, a power of two, and of slots taken */
+	struct Boundary *bounds[32];    /* word boundaries sorted by the bytes after them, in runs merged as in a binary counter */
+	size_t nbounds[32];
+	struct Boundary *carry;         /* run being merged into the runs, a step at a time; looked up as one of them until then */
+	size_t ncarry;
+	struct Boundary *merged;        /* carry merged with the run it is merged into, as far as it is */
+	size_t mergek, mergei, mergej;  /* run it is merged into, and boundaries of both merged */
+	int coded;                      /* whether items are front-coded, as their boundaries are not kept */
+	size_t nitems, gen;             /* number and generation of the items indexed, the first ones */
+	struct Matches cands;           /* items looked up for the input last */
+	struct Matches prefix;          /* the ones of them matching it at a word boundary */
+};
+
+/* completion item, as found from its table to be drawn or printed */
 struct Item {
-	struct Group *group;                    /* item group */
-	struct Item *prevmatch, *nextmatch;     /* previous and next items */
-	struct Item *prev, *next;               /* previous and next matched items */
-	char *text;                             /* content of the completion item */
-	char *description;                      /* description of the completion item */
-	char *output;                           /* text to be output */
+	uint32_t group;                         /* number of the item group, 0 for none */
+	const char *groupname;                  /* name of the item group */
+	const char *text;                       /* content of the completion item */
+	const char *description;                /* description of the completion item */
+	const char *output;                     /* text to be output */
+	size_t textlen, desclen, outlen;        /* length of the strings */
+	enum Field field;                       /* field that matched the input */
+};
+
+/* lines being parsed into items, possibly by a worker thread; also a batch of items handed to the event loop */
+struct Parse {
+	struct Parse *next;             /* next batch in the queue */
+	struct Source *source;          /* source the lines were read from */
+	const char *beg, *end;          /* lines to be parsed */
+	struct Table table;             /* items and groups created */
+	uint32_t group;                 /* group of the last line parsed, 0 before the first group */
+	struct Arena arena;             /* memory the groups and the front-coded lines are allocated from */
+	struct Coder coder;             /* lines written with -P */
+	int setgroup;                   /* whether the next line names a group */
+
+	/* with -w, a batch replaces the lines that changed in a watched file */
+	int reload;                     /* whether the batch is a reload */
+	char *buf, *oldbuf;             /* new and old contents of the file */
+	size_t len, oldlen;             /* length of the new and old contents */
+	size_t prefix, suffix;          /* bytes kept from the beginning and the end of the old contents */
+};
+
+/* header of the image of the items of a file, with -c; the image is valid only for the file as it was */
+struct CacheHeader {
+	char magic[8];                  /* CACHEMAGIC, written once the image is complete */
+	uint64_t dev, ino, size;        /* file the items were read from */
+	int64_t mtime, mtimensec;       /* time the file was last modified */
+	uint64_t pos;                   /* offset the file was read from */
+	uint64_t flags;                 /* options the items depend on */
+};
+
+/*
+ * batch of items in an image, followed by its runs, the offsets,
+ * lengths and groups of its items, the names of its groups, and its
+ * lines that are not in the file, each section padded to 8 bytes
+ */
+struct CacheBatch {
+	uint64_t nitems, nruns, ngroups;
+	uint64_t namelen;               /* size of the names of the groups, each followed by a nul */
+	uint64_t datalen;               /* size of the lines that are not in the file */
+	uint64_t group;                 /* group of the last line of the batch */
+};
+
+/* run of items in an image */
+struct CacheRun {
+	uint64_t first;                 /* index of the first item of the run */
+	uint64_t base;                  /* offset of the text of the items in the file, or in the lines of the batch */
+	uint32_t inimage;               /* whether the text is in the lines of the batch */
+	uint32_t coded;                 /* whether base is a block of front-coded lines */
+};
+
+/* mapped memory that items point into */
+struct Chunk {
+	struct Chunk *next;
+	char *buf;
+	size_t size;
+	off_t off;                      /* offset of the chunk in the spool file, -1 if it is not in it */
+};
+
+/* file items are read from, by its own thread */
+struct Source {
+	struct Source *next;
+	const char *name;               /* name of the file, "-" for stdin */
+	pthread_t thread;               /* thread reading the file */
+	int running;                    /* whether the thread was started */
+	int fd;                         /* file being read */
+	struct Chunk *chunks;           /* list of chunks of input */
+	char *buf;                      /* file mapping, or chunk the file is spooled into */
+	size_t pos;                     /* position of the first line not parsed yet */
+	size_t len;                     /* number of bytes read into buf */
+	size_t size;                    /* size of buf */
+	int map;                        /* whether buf is a mapping of the file */
+	int spoolfd;                    /* unlinked file the input is spooled into */
+	off_t spoolsize;                /* size of the spool file */
+	int setgroup;                   /* whether the next line names a group */
+	int eof;                        /* whether the file reached end of file */
+	uint32_t group;                 /* group of the last items added to the prompt, 0 for none */
+	int watch;                      /* whether the file is watched for changes */
+	int wfd;                        /* inotify instance watching the file */
+	pid_t pid;                      /* process group writing into the file, with -e */
+
+	/* with -c, the items of the file are read from an image of them, or written into one */
+	int cache;                      /* whether the items of the file are cached */
+	struct CacheHeader cachehdr;    /* header of the image for the file as it is */
+	const char *file;               /* mapping of the file */
+	char *image;                    /* mapping of the image the items are read from */
+	size_t imagesize;
+	FILE *cachefp;                  /* image being written */
+	char *cachetmp;                 /* name of the image being written */
 };
 
 /* undo list entry */
@@ -182,16 +465,40 @@ struct Prompt {
 	struct Undo *undocurr;          /* current undo entry */
 
 	/* items */
-	struct Group *groups;           /* list of item groups */
-	struct Item *head, *tail;       /* list of items */
-	struct Item *fhead, *ftail;     /* list of file completion items */
-	struct Item *firstmatch;        /* first item that matches input */
-	struct Item *matchlist;         /* first item that matches input to be listed */
-	struct Item *selitem;           /* selected item */
-	struct Item *hoveritem;         /* hovered item */
-	struct Item **itemarray;        /* array containing nitems matching text */
-	size_t nitems;                  /* number of items in itemarray */
-	size_t maxitems;                /* maximum number of items in itemarray */
+	struct Arena arena;             /* memory the groups are allocated from */
+	size_t arenadead;               /* bytes of the arena no group or item refers to anymore, as far as known */
+	struct Arena files;             /* memory the file completion items are allocated from */
+	struct Table items;             /* items read from the sources */
+	struct Table fitems;            /* file completion items */
+	struct Matches matches[ClassLast]; /* items that match input, listed class after class */
+	char *matchtext;                /* input the items were matched against */
+	size_t scanned;                 /* number of items matched against it, the first ones */
+	struct Index index;             /* trigram index of the items, with -t */
+	int stale;                      /* whether matching against matchtext was cancelled halfway */
+	char *posttext;                 /* input posted to the thread listing the matching items */
+	size_t postgen, listgen;        /* number of inputs posted, and done by the thread */
+	int matching;                   /* whether the thread has the items and their lists */
+	struct Rank *ranks;             /* best matching items, best first, with -z */
+	size_t nranks, maxranks;        /* number of items ranked, and most that are */
+	struct Memo *memos;             /* lists of matching items for inputs left, most recently used first */
+	size_t memosize;                /* bytes taken by the memos */
+	size_t itemgen;                 /* incremented whenever items are removed, which makes the memos stale */
+	size_t matchlist;               /* position of the first item that matches input to be listed */
+	size_t selitem;                 /* position of the selected item, NOITEM for none */
+	size_t hoveritem;               /* position of the hovered item, NOITEM for none */
+	size_t nitems;                  /* number of items listed */
+	size_t maxitems;                /* maximum number of items listed */
+
+	/* sources of items */
+	struct Source *sources;         /* list of sources */
+	char *query;                    /* input the command was last run with, with -e */
+	struct timespec rerun;          /* when to run the command again */
+	int pending;                    /* whether the command has to be run again */
+
+	/* set of unique items, an open addressing hash table */
+	uint32_t *uniq;                 /* hash table of item indices plus one, 0 for free slots */
+	size_t uniqsize;                /* number of slots, a power of two */
+	size_t nuniq;                   /* number of items in the table */
 
 	/* prompt geometry */
 	int w, h;                       /* width and height of xprompt */
@@ -204,9 +511,8 @@ struct Prompt {
 	Window win;                     /* xprompt window */
 };
 
-/* entry for list of group names */
+/* group of items */
 struct Group {
-	struct Group *next;
 	char *name;
 };
 
@@ -227,11 +533,52 @@ static Atom atoms[AtomLast];
 /* flags */
 static int fflag = 0;   /* whether to enable filename completion */
 static int gflag = 0;   /* whether to group read lines */
+static int lflag = 0;   /* whether to match the items past the first screen only when needed */
+static int iflag = 0;   /* whether to match the input case insensitively */
 static int pflag = 0;   /* whether to enable password mode */
+static int tflag = 0;   /* whether to index the trigrams of the items */
+static int uflag = 0;   /* whether to discard duplicate items */
+static int Gflag = 0;   /* whether to group items by source */
+static int Pflag = 0;   /* whether to store the items front-coded */
+static int wflag = 0;   /* whether to reload files when they change */
+static int zflag = 0;   /* whether to match the input as a subsequence and rank the items */
+static char *ecmd = NULL;       /* command run for each input to get the items */
+static char *cachefile = NULL;  /* file the items of the first source are cached in */
+
+/* bitmask of the fields matched against the input */
+static unsigned matchfields = 1 << FieldText;
+
+/* number of threads to use */
+static size_t nthreads = 1;
+
+/* whether blocks of front-coded lines are skipped by their filter; not if the locale folds case across it */
+static int filterblocks = 1;
+
+/* batches of items handed from the source threads to the event loop */
+static pthread_mutex_t batchlock = PTHREAD_MUTEX_INITIALIZER;
+static struct Parse *batchhead, *batchtail;
+static int batchpipe[2] = {-1, -1};     /* written to when a batch is queued */
+
+/* threads matching items against the input along with the event loop, started the first time many items are matched */
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobposted = PTHREAD_COND_INITIALIZER;     /* signaled when a job is posted */
+static pthread_cond_t jobdone = PTHREAD_COND_INITIALIZER;       /* signaled when the slices of a job are all matched */
+static struct Job job;
+static pthread_t *matchers;
+static size_t nmatchers;
+
+/* thread listing the items that match the input in the background, so the event loop is not held up by it */
+static pthread_cond_t inputposted = PTHREAD_COND_INITIALIZER;   /* signaled when the input is posted */
+static pthread_cond_t inputdone = PTHREAD_COND_INITIALIZER;     /* signaled when the input posted last is done */
+static pthread_t lister;
+static int listpipe[2] = {-1, -1};      /* written to when the input posted last is done */
 
 /* comparison function */
 static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
 
+/* substring search function, picked for the processor by initsearch() */
+static const char *(*findstr)(const char *, size_t, const char *, size_t);
+
 /* Include defaults */
 #include "config.h"
 
@@ -239,10 +586,32 @@ static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: xfilter [-fgip] [-h file] [file...]\n");
+	(void)fprintf(stderr, "usage: xfilter [-fgGilPptuwz] [-c cachefile] [-e command] [-h file] [-m fields] [-s file]... [file...]\n");
 	exit(1);
 }
 
+/* parse comma-separated list of field numbers into a bitmask of fields; return 0 on error */
+static unsigned
+parsefields(const char *s)
+{
+	unsigned fields;
+	long n;
+	char *endp;
+
+	fields = 0;
+	for (;;) {
+		n = strtol(s, &endp, 10);
+		if (endp == s || n < 1 || n > FieldLast)
+			return 0;
+		fields |= 1 << (n - 1);
+		if (*endp == '\0')
+			return fields;
+		if (*endp != ',')
+			return 0;
+		s = endp + 1;
+	}
+}
+
 /* call strdup checking for error */
 static char *
 estrdup(const char *s)
@@ -276,6 +645,15 @@ emalloc(size_t size)
 	return p;
 }
 
+/* call realloc checking for error */
+static void *
+erealloc(void *p, size_t size)
+{
+	if ((p = realloc(p, size)) == NULL)
+		err(1, "realloc");
+	return p;
+}
+
 /* get configuration from X resources */
 static void
 getresources(void)
@@ -409,196 +787,810 @@ initcursor(void)
 	cursor = XCreateFontCursor(dpy, XC_xterm);
 }
 
-/* allocate item */
-static struct Item *
-allocitem(const char *text, const char *description, const char *output, struct Group *group)
+/* allocate size bytes from arena */
+static void *
+arenaalloc(struct Arena *arena, size_t size)
+{
+	struct Block *block;
+	size_t n;
+	void *p;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if ((size_t)(arena->end - arena->pos) < size) {
+		/* blocks double in size, so that few of them hold lots of items */
+		arena->size = (arena->size == 0) ? BLOCKSIZ : MIN(arena->size * 2, MAXBLOCKSIZ);
+		n = MAX(arena->size, sizeof(*block) + size);
+		block = emalloc(n);
+		block->size = n;
+		arena->total += n;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		if (arena->last == NULL)
+			arena->last = block;
+		arena->pos = (char *)(block + 1);
+		arena->end = (char *)block + n;
+	}
+	p = arena->pos;
+	arena->pos += size;
+	return p;
+}
+
+/* allocate a block of size bytes of its own from arena, so it does not waste the rest of the one arena allocates from */
+static void *
+arenablock(struct Arena *arena, size_t size)
+{
+	struct Block *block;
+
+	block = emalloc(sizeof(*block) + size);
+	block->size = sizeof(*block) + size;
+	arena->total += block->size;
+	if (arena->blocks == NULL) {
+		block->next = NULL;
+		arena->blocks = arena->last = block;
+		arena->pos = arena->end = (char *)block + block->size;
+	} else {
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+		if (arena->last == arena->blocks)
+			arena->last = block;
+	}
+	return block + 1;
+}
+
+/* move the blocks of src into dst, after the one dst allocates from */
+static void
+mergearena(struct Arena *dst, struct Arena *src)
+{
+	if (src->blocks == NULL)
+		return;
+	if (dst->blocks == NULL) {
+		*dst = *src;
+	} else {
+		src->last->next = dst->blocks->next;
+		dst->blocks->next = src->blocks;
+		if (dst->last == dst->blocks)
+			dst->last = src->last;
+		dst->total += src->total;
+	}
+	src->blocks = src->last = NULL;
+	src->pos = src->end = NULL;
+	src->total = 0;
+}
+
+/* free all the memory allocated from arena but its first block, which is reused */
+static void
+resetarena(struct Arena *arena)
+{
+	struct Block *block, *next;
+
+	if (arena->blocks == NULL)
+		return;
+	for (block = arena->blocks->next; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena->blocks->next = NULL;
+	arena->last = arena->blocks;
+	arena->pos = (char *)(arena->blocks + 1);
+	arena->end = (char *)arena->blocks + arena->blocks->size;
+	arena->total = arena->blocks->size;
+}
+
+/* free all the memory allocated from arena */
+static void
+freearena(struct Arena *arena)
+{
+	struct Block *block, *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena->blocks = arena->last = NULL;
+	arena->pos = arena->end = NULL;
+	arena->size = arena->total = 0;
+}
+
+/* copy the name of a file completion item, it is followed by a nul like the text of the other items */
+static const char *
+allocfilename(struct Arena *arena, const char *path)
 {
-	struct Item *item;
+	char *name;
+	size_t len;
 
-	item = emalloc(sizeof(*item));
-	item->text = estrdup(text);
-	item->description = description ? estrdup(description) : NULL;
-	item->output = output ? estrdup(output) : NULL;
-	item->group = group;
-	item->prevmatch = item->nextmatch = NULL;
-	item->prev = item->next = NULL;
+	len = strlen(path);
+	name = arenaalloc(arena, len + 1);
+	memcpy(name, path, len + 1);
+	return name;
+}
 
-	return item;
+/* get the number of bytes allocated from an arena for a group */
+static size_t
+groupbytes(struct Group *group)
+{
+	return (sizeof(*group) + strlen(group->name) + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
 }
 
-/* allocate group */
+/* allocate group, its name is stored right after the group */
 static struct Group *
-allocgroup(struct Group *prev, const char *name)
+allocgroup(struct Arena *arena, const char *name, size_t len)
 {
 	struct Group *group;
 
-	group = emalloc(sizeof(*group));
-	group->next = prev;
-	group->name = estrdup(name);
+	group = arenaalloc(arena, sizeof(*group) + len + 1);
+	group->name = (char *)(group + 1);
+	memcpy(group->name, name, len);
+	group->name[len] = '\0';
 	return group;
 }
 
-/* get next utf8 char from s return its codepoint and set next_ret to pointer to end of character */
-static FcChar32
-getnextutf8char(const char *s, const char **next_ret)
+/* hash a string of len bytes, seeded with a group number */
+static size_t
+hashkey(const char *key, size_t len, uint32_t group)
 {
-	static const unsigned char utfbyte[] = {0x80, 0x00, 0xC0, 0xE0, 0xF0};
-	static const unsigned char utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
-	static const FcChar32 utfmin[] = {0, 0x00,  0x80,  0x800,  0x10000};
-	static const FcChar32 utfmax[] = {0, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
-	/* 0xFFFD is the replacement character, used to represent unknown characters */
-	static const FcChar32 unknown = 0xFFFD;
-	FcChar32 ucode;         /* FcChar32 type holds 32 bits */
-	size_t usize = 0;       /* n' of bytes of the utf8 character */
 	size_t i;
+	uint64_t h;
 
-	*next_ret = s+1;
+	/* FNV-1a */
+	h = 14695981039346656037ULL ^ group;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h ^ (h >> 32);
+}
 
-	/* get code of first byte of utf8 character */
-	for (i = 0; i < sizeof utfmask; i++) {
-		if (((unsigned char)*s & utfmask[i]) == utfbyte[i]) {
-			usize = i;
-			ucode = (unsigned char)*s & ~utfmask[i];
-			break;
-		}
+/* find the group named name in table; return its number, 0 if there is none */
+static uint32_t
+findgroup(struct Table *table, const char *name, size_t len)
+{
+	struct Group *group;
+	size_t mask, i;
+
+	if (table->namesize == 0)
+		return 0;
+	mask = table->namesize - 1;
+	for (i = hashkey(name, len, 0) & mask; table->names[i]; i = (i + 1) & mask) {
+		group = table->groups[table->names[i] - 1];
+		if (strncmp(group->name, name, len) == 0 && group->name[len] == '\0')
+			return table->names[i];
 	}
+	return 0;
+}
 
-	/* if first byte is a continuation byte or is not allowed, return unknown */
-	if (i == sizeof utfmask || usize == 0)
-		return unknown;
+/* add group to table, whose groups have different names; return its number */
+static uint32_t
+addgroup(struct Table *table, struct Group *group)
+{
+	size_t mask, i, j;
 
-	/* check the other usize-1 bytes */
-	s++;
-	for (i = 1; i < usize; i++) {
-		*next_ret = s+1;
-		/* if byte is nul or is not a continuation byte, return unknown */
-		if (*s == '\0' || ((unsigned char)*s & utfmask[0]) != utfbyte[0])
-			return unknown;
-		/* 6 is the number of relevant bits in the continuation byte */
-		ucode = (ucode << 6) | ((unsigned char)*s & ~utfmask[0]);
-		s++;
+	if (table->ngroups == table->groupsize) {
+		table->groupsize = table->groupsize ? table->groupsize * 2 : 64;
+		table->groups = erealloc(table->groups, table->groupsize * sizeof(*table->groups));
 	}
+	table->groups[table->ngroups++] = group;
+
+	/* the groups are indexed by name, keeping the load factor below one half */
+	if (2 * table->ngroups > table->namesize) {
+		free(table->names);
+		table->namesize = table->namesize ? table->namesize * 2 : 128;
+		table->names = ecalloc(table->namesize, sizeof(*table->names));
+		mask = table->namesize - 1;
+		for (j = 0; j + 1 < table->ngroups; j++) {
+			for (i = hashkey(table->groups[j]->name, strlen(table->groups[j]->name), 0) & mask; table->names[i]; i = (i + 1) & mask)
+				;
+			table->names[i] = j + 1;
+		}
+	}
+	mask = table->namesize - 1;
+	for (i = hashkey(group->name, strlen(group->name), 0) & mask; table->names[i]; i = (i + 1) & mask)
+		;
+	table->names[i] = table->ngroups;
+	return table->ngroups;
+}
 
-	/* check if ucode is invalid or in utf-16 surrogate halves */
-	if (!BETWEEN(ucode, utfmin[usize], utfmax[usize]) || BETWEEN (ucode, 0xD800, 0xDFFF))
-		return unknown;
+/* get the number of the group named name in table, adding a group allocated from arena if there is none */
+static uint32_t
+interngroup(struct Table *table, struct Arena *arena, const char *name, size_t len)
+{
+	uint32_t group;
 
-	return ucode;
+	if ((group = findgroup(table, name, len)) != 0)
+		return group;
+	return addgroup(table, allocgroup(arena, name, len));
 }
 
-/* get which font contains a given code point */
-static XftFont *
-getfontucode(FcChar32 ucode)
+/*
+ * add the groups of src to dst, but those named as a group of dst;
+ * return an array mapping the group numbers of src to the ones in dst,
+ * with group 0 mapped to nogroup
+ */
+static uint32_t *
+mergegroups(struct Table *dst, struct Table *src, uint32_t nogroup)
 {
-	FcCharSet *fccharset = NULL;
-	FcPattern *fcpattern = NULL;
-	FcPattern *match = NULL;
-	FcResult result;
-	XftFont *retfont = NULL;
+	uint32_t *map;
 	size_t i;
 
-	/* search through the fonts supplied by the user for the first one supporting ucode */
-	for (i = 0; i < dc.nfonts; i++)
-		if (XftCharExists(dpy, dc.fonts[i], ucode) == FcTrue)
-			return dc.fonts[i];
+	map = emalloc((src->ngroups + 1) * sizeof(*map));
+	map[0] = nogroup;
+	for (i = 0; i < src->ngroups; i++)
+		if ((map[i + 1] = findgroup(dst, src->groups[i]->name, strlen(src->groups[i]->name))) == 0)
+			map[i + 1] = addgroup(dst, src->groups[i]);
+	return map;
+}
 
-	/* if could not find a font in dc.fonts, search through system fonts */
+/* write n into p as a sequence of 7-bit bytes, the last one with the high bit clear; return the end of it */
+static char *
+putvarint(char *p, size_t n)
+{
+	while (n >= 0x80) {
+		*p++ = (n & 0x7F) | 0x80;
+		n >>= 7;
+	}
+	*p++ = n;
+	return p;
+}
 
-	/* create a charset containing our code point */
-	fccharset = FcCharSetCreate();
-	FcCharSetAddChar(fccharset, ucode);
+/* read into *n the number written at p by putvarint(); return the end of it */
+static const char *
+getvarint(const char *p, size_t *n)
+{
+	unsigned shift;
 
-	/* create a pattern akin to the dc.pattern but containing our charset */
-	if (fccharset) {
-		fcpattern = FcPatternDuplicate(dc.pattern);
-		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-	}
+	*n = 0;
+	for (shift = 0; *(unsigned char *)p & 0x80; shift += 7)
+		*n |= (size_t)(*(unsigned char *)p++ & 0x7F) << shift;
+	*n |= (size_t)*(unsigned char *)p++ << shift;
+	return p;
+}
 
-	/* find font matching fcpattern */
-	if (fcpattern) {
-		FcDefaultSubstitute(fcpattern);
-		FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-		match = FcFontMatch(NULL, fcpattern, &result);
-	}
+/*
+ * fold the case of a byte for the filter of a block; bytes out of ascii
+ * are all the same to it.  This folds case as -i does in the C and
+ * UTF-8 locales and most others, but not in a locale where tolower()
+ * maps an ascii letter out of ascii, see initfilter()
+ */
+static unsigned
+filterbyte(unsigned char c)
+{
+	if (c >= 0x80)
+		return 0x80;
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
 
-	/* if found a font, open it */
-	if (match && result == FcResultMatch) {
-		retfont = XftFontOpenPattern(dpy, match);
-		if (retfont && XftCharExists(dpy, retfont, ucode) == FcTrue) {
-			if ((dc.fonts = realloc(dc.fonts, dc.nfonts+1)) == NULL)
-				err(1, "realloc");
-			dc.fonts[dc.nfonts] = retfont;
-			return dc.fonts[dc.nfonts++];
-		} else {
-			XftFontClose(dpy, retfont);
-		}
-	}
+/* get the bits of the filter of a block standing for the pair of bytes at s */
+static void
+filterbits(const char *s, size_t *a, size_t *b)
+{
+	uint32_t h;
 
-	/* in case no fount was found, return the first one */
-	return dc.fonts[0];
+	h = (filterbyte(s[0]) << 8 | filterbyte(s[1])) * 0x9E3779B1U;
+	*a = (h >> 16) % (FILTERSIZ * 8);
+	*b = (h & 0xFFFF) % (FILTERSIZ * 8);
 }
 
-/* draw text into XftDraw, return width of text glyphs */
-static int
-drawtext(XftDraw *draw, XftColor *color, int x, int y, unsigned h, const char *text, size_t textlen)
+/* add the pairs of bytes of s, of length len, from the one at from on, to the filter of a block */
+static void
+filteradd(unsigned char *filter, const char *s, size_t from, size_t len)
 {
-	int textwidth = 0;
-	XftFont *currfont, *nextfont;
-	XGlyphInfo ext;
-	FcChar32 ucode;
-	const char *next, *tmp, *end;
-	size_t len = 0;
+	size_t a, b;
 
-	nextfont = dc.fonts[0];
-	end = text + textlen;
-	while (*text && (!textlen || text < end)) {
-		tmp = text;
-		do {
-			next = tmp;
-			currfont = nextfont;
-			ucode = getnextutf8char(next, &tmp);
-			nextfont = getfontucode(ucode);
-		} while (*next && (!textlen || next < end) && currfont == nextfont);
-		len = next - text;
-		XftTextExtentsUtf8(dpy, currfont, (XftChar8 *)text, len, &ext);
-		textwidth += ext.xOff;
-		if (draw) {
-			int texty;
+	for (; from + 1 < len; from++) {
+		filterbits(s + from, &a, &b);
+		filter[a / 8] |= 1 << (a % 8);
+		filter[b / 8] |= 1 << (b % 8);
+	}
+}
 
-			texty = y + (h - (currfont->ascent + currfont->descent))/2 + currfont->ascent;
-			XftDrawStringUtf8(draw, color, currfont, x, texty, (XftChar8 *)text, len);
-			x += ext.xOff;
-		}
-		text = next;
+/* check whether the lines of a block may contain text, of length len, as the filter at the beginning of the block says */
+static int
+filtermatch(const char *block, const char *text, size_t len)
+{
+	const unsigned char *filter;
+	size_t a, b, i;
+
+	/* the bytes of the input need not be next to each other in a subsequence */
+	if (zflag || !filterblocks)
+		return 1;
+	filter = (const unsigned char *)block;
+	for (i = 0; i + 1 < len; i++) {
+		filterbits(text + i, &a, &b);
+		if (!(filter[a / 8] & (1 << (a % 8))) || !(filter[b / 8] & (1 << (b % 8))))
+			return 0;
 	}
-	return textwidth;
+	return 1;
 }
 
-/* draw the text on input field, return position of the cursor */
+/* with -i, check whether the filters of the blocks fold case as tolower() does in the locale; the blocks are not skipped otherwise */
 static void
-drawinput(struct Prompt *prompt, int copy)
+initfilter(void)
 {
-	unsigned minpos, maxpos;
-	unsigned curpos;            /* where to draw the cursor */
-	int x, y, xtext;
-	int widthpre, widthsel, widthpos;
+	int c;
 
-	if (pflag)
+	if (!iflag)
 		return;
+	for (c = 0; c <= UCHAR_MAX; c++)
+		if (filterbyte(tolower(c)) != filterbyte(c))
+			filterblocks = 0;
+}
 
-	x = dc.pad;
-
-	minpos = MIN(prompt->cursor, prompt->select);
-	maxpos = MAX(prompt->cursor, prompt->select);
+/* write a line of len bytes with coder, into a block allocated from arena; return where it was written */
+static const char *
+encodeline(struct Coder *coder, struct Arena *arena, const char *line, size_t len)
+{
+	size_t shared;
+	char *p, *s;
+
+	shared = 0;
+	while (shared < len && shared < coder->prevlen && line[shared] == coder->prev[shared])
+		shared++;
+
+	/* a new block starts with a whole line; a line longer than a block gets a block of its own */
+	if (coder->block == NULL || coder->size - coder->pos < 2 * VARINTSIZ + len - shared) {
+		shared = 0;
+		coder->size = MAX(CODESIZ, FILTERSIZ + 2 * VARINTSIZ + len);
+		coder->block = arenablock(arena, coder->size);
+		memset(coder->block, 0, FILTERSIZ);
+		coder->pos = FILTERSIZ;
+	}
 
-	/* draw background */
-	XSetForeground(dpy, dc.gc, dc.normal[ColorBG].pixel);
-	XFillRectangle(dpy, prompt->pixmap, dc.gc, x, 0,
-	               prompt->w - x, prompt->h);
+	/* the pairs within the shared prefix are already in the filter */
+	filteradd((unsigned char *)coder->block, line, (shared > 0) ? shared - 1 : 0, len);
+	s = coder->block + coder->pos;
+	p = putvarint(s, shared);
+	p = putvarint(p, len - shared);
+	memcpy(p, line + shared, len - shared);
+	coder->pos = p + len - shared - coder->block;
+
+	if (len > coder->prevsize) {
+		coder->prevsize = MAX(len, 2 * coder->prevsize);
+		coder->prev = erealloc(coder->prev, coder->prevsize);
+	}
+	memcpy(coder->prev, line, len);
+	coder->prevlen = len;
+	return s;
+}
 
-	/* draw text before selection */
-	xtext = x;
-	widthpre = (minpos)
+/* get the contents of the line written at s in a block, decoding the lines of the block before it */
+static const char *
+decodeline(struct Decoder *dec, const char *block, const char *s)
+{
+	const char *p;
+	size_t shared, n;
+
+	/* lines are usually decoded in order, so each one is decoded from the one before it */
+	if (dec->block == block && dec->line == s)
+		return dec->buf;
+	if (dec->block != block || (uintptr_t)dec->next > (uintptr_t)s) {
+		dec->block = block;
+		dec->next = block + FILTERSIZ;
+	}
+	do {
+		dec->line = dec->next;
+		p = getvarint(dec->line, &shared);
+		p = getvarint(p, &n);
+		if (shared + n + 1 > dec->size) {
+			dec->size = MAX(shared + n + 1, 2 * dec->size);
+			dec->buf = erealloc(dec->buf, dec->size);
+		}
+		memcpy(dec->buf + shared, p, n);
+		dec->buf[shared + n] = '\0';
+		dec->next = p + n;
+	} while (dec->line != s);
+	return dec->buf;
+}
+
+/* get the number of bytes of the line written at s in a block, and the length of its contents into *len */
+static size_t
+codedsize(const char *s, size_t *len)
+{
+	const char *p;
+	size_t shared, n;
+
+	p = getvarint(s, &shared);
+	p = getvarint(p, &n);
+	*len = shared + n;
+	return p + n - s;
+}
+
+/* append item with text of len bytes to table; if block is not NULL, text is a line written into it by a coder */
+static void
+additem(struct Table *table, const char *block, const char *text, size_t len, uint32_t group)
+{
+	struct Run *run;
+
+	if (len > UINT32_MAX)
+		errx(1, "item too long");
+	if (table->nitems == table->size) {
+		if (table->nitems == UINT32_MAX)
+			errx(1, "too many items");
+		table->size = table->size ? MIN(table->size * 2, UINT32_MAX) : 1024;
+		table->off = erealloc(table->off, table->size * sizeof(*table->off));
+		table->len = erealloc(table->len, table->size * sizeof(*table->len));
+		table->match = erealloc(table->match, table->size * sizeof(*table->match));
+		if (gflag || Gflag) {
+			table->group = erealloc(table->group, table->size * sizeof(*table->group));
+		}
+	}
+
+	/*
+	 * a run starts wherever the text cannot be reached with an offset
+	 * from the base of the last one, and with each block of lines
+	 */
+	run = (table->nruns > 0) ? &table->runs[table->nruns - 1] : NULL;
+	if (run == NULL || ((block != NULL) ? (!run->coded || run->base != block) :
+	    (run->coded || (uintptr_t)text < (uintptr_t)run->base ||
+	     (uintptr_t)text - (uintptr_t)run->base > UINT32_MAX))) {
+		if (table->nruns == table->runsize) {
+			table->runsize = table->runsize ? table->runsize * 2 : 64;
+			table->runs = erealloc(table->runs, table->runsize * sizeof(*table->runs));
+		}
+		run = &table->runs[table->nruns++];
+		run->first = table->nitems;
+		run->base = (block != NULL) ? block : text;
+		run->coded = (block != NULL);
+	}
+	table->off[table->nitems] = (uintptr_t)text - (uintptr_t)run->base;
+	table->len[table->nitems] = len;
+	if (table->group != NULL)
+		table->group[table->nitems] = group;
+	table->match[table->nitems] = MATCHNEW;
+	table->nitems++;
+}
+
+/* get the run of item i of table */
+static struct Run *
+itemrun(struct Table *table, size_t i)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = table->nruns;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (table->runs[mid].first <= i)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &table->runs[lo];
+}
+
+/* get the text, or the coded line, of item i of table, which is in *run or in the run after it; *run is updated */
+static const char *
+nexttext(struct Table *table, size_t i, struct Run **run)
+{
+	if (*run + 1 < table->runs + table->nruns && (*run)[1].first == i)
+		(*run)++;
+	return (*run)->base + table->off[i];
+}
+
+/* get the run of item i of table, which is run or a run after it */
+static struct Run *
+seekrun(struct Table *table, struct Run *run, size_t i)
+{
+	while (run + 1 < table->runs + table->nruns && run[1].first <= i)
+		run++;
+	return run;
+}
+
+/* get the text of an item of a run of table, given its text or its coded line s */
+static const char *
+runtext(struct Table *table, struct Run *run, const char *s)
+{
+	return run->coded ? decodeline(&table->dec, run->base, s) : s;
+}
+
+/* get the text of item i of table */
+static const char *
+itemtext(struct Table *table, size_t i)
+{
+	struct Run *run;
+
+	run = itemrun(table, i);
+	return runtext(table, run, run->base + table->off[i]);
+}
+
+/* get the group number of item i of table, 0 for none */
+static uint32_t
+itemgroup(struct Table *table, size_t i)
+{
+	return (table->group != NULL) ? table->group[i] : 0;
+}
+
+/* find the description and the output of item, which follow its text after tabs */
+static void
+splititem(struct Item *item)
+{
+	const char *s;
+
+	item->description = item->output = NULL;
+	item->desclen = item->outlen = 0;
+	s = item->text + item->textlen;
+	if (*s != '\t')
+		return;
+	item->description = ++s;
+	s += strcspn(s, "\t\n");
+	item->desclen = s - item->description;
+	if (*s != '\t')
+		return;
+	item->output = ++s;
+	s += strcspn(s, "\n");
+	item->outlen = s - item->output;
+}
+
+/* get item i of table */
+static void
+loaditem(struct Table *table, size_t i, struct Item *item)
+{
+	item->text = itemtext(table, i);
+	item->textlen = table->len[i];
+	item->group = itemgroup(table, i);
+	item->groupname = (item->group != 0) ? table->groups[item->group - 1]->name : NULL;
+	item->field = table->match[i] & ~MATCHPREFIX;
+	splititem(item);
+}
+
+/* forget the items and groups of table, keeping the memory for new ones */
+static void
+cleartable(struct Table *table)
+{
+	table->nitems = table->nruns = table->ngroups = 0;
+	table->dec.block = NULL;
+	if (table->names != NULL)
+		memset(table->names, 0, table->namesize * sizeof(*table->names));
+}
+
+/* free the items and groups of table */
+static void
+freetable(struct Table *table)
+{
+	free(table->off);
+	free(table->len);
+	free(table->group);
+	free(table->match);
+	free(table->runs);
+	free(table->groups);
+	free(table->names);
+	free(table->dec.buf);
+	memset(table, 0, sizeof(*table));
+}
+
+/* get the table of the items of a class of matching items */
+static struct Table *
+classtable(struct Prompt *prompt, enum Class class)
+{
+	return (class == ClassFilePrefix || class == ClassFileMiddle) ? &prompt->fitems : &prompt->items;
+}
+
+/* get the class and the index in its table of the item at position pos of the list of matching items; return 0 if there is none */
+static int
+matchitem(struct Prompt *prompt, size_t pos, enum Class *class, size_t *i)
+{
+	enum Class c;
+
+	if (pos == NOITEM)
+		return 0;
+	if (zflag) {
+		if (pos >= prompt->nranks)
+			return 0;
+		*class = prompt->ranks[pos].class;
+		*i = prompt->ranks[pos].i;
+		return 1;
+	}
+	for (c = 0; c < ClassLast; c++) {
+		if (pos < prompt->matches[c].n) {
+			*class = c;
+			*i = prompt->matches[c].items[pos];
+			return 1;
+		}
+		pos -= prompt->matches[c].n;
+	}
+	return 0;
+}
+
+/* get the item at position pos of the list of matching items */
+static void
+getmatch(struct Prompt *prompt, size_t pos, struct Item *item)
+{
+	enum Class class;
+	size_t i;
+
+	if (matchitem(prompt, pos, &class, &i)) {
+		loaditem(classtable(prompt, class), i, item);
+	}
+}
+
+/* add mapped memory to the list of chunks to be unmapped at exit */
+static void
+addchunk(struct Source *src, char *buf, size_t size, off_t off)
+{
+	struct Chunk *chunk;
+
+	chunk = emalloc(sizeof(*chunk));
+	chunk->buf = buf;
+	chunk->size = size;
+	chunk->off = off;
+	chunk->next = src->chunks;
+	src->chunks = chunk;
+}
+
+/* unmap the chunks of input of a source */
+static void
+freechunks(struct Source *src)
+{
+	struct Chunk *chunk;
+
+	while ((chunk = src->chunks) != NULL) {
+		src->chunks = chunk->next;
+		munmap(chunk->buf, chunk->size);
+		free(chunk);
+	}
+}
+
+/* get next utf8 char from s return its codepoint and set next_ret to pointer to end of character */
+static FcChar32
+getnextutf8char(const char *s, const char **next_ret)
+{
+	static const unsigned char utfbyte[] = {0x80, 0x00, 0xC0, 0xE0, 0xF0};
+	static const unsigned char utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
+	static const FcChar32 utfmin[] = {0, 0x00,  0x80,  0x800,  0x10000};
+	static const FcChar32 utfmax[] = {0, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+	/* 0xFFFD is the replacement character, used to represent unknown characters */
+	static const FcChar32 unknown = 0xFFFD;
+	FcChar32 ucode;         /* FcChar32 type holds 32 bits */
+	size_t usize = 0;       /* n' of bytes of the utf8 character */
+	size_t i;
+
+	*next_ret = s+1;
+
+	/* get code of first byte of utf8 character */
+	for (i = 0; i < sizeof utfmask; i++) {
+		if (((unsigned char)*s & utfmask[i]) == utfbyte[i]) {
+			usize = i;
+			ucode = (unsigned char)*s & ~utfmask[i];
+			break;
+		}
+	}
+
+	/* if first byte is a continuation byte or is not allowed, return unknown */
+	if (i == sizeof utfmask || usize == 0)
+		return unknown;
+
+	/* check the other usize-1 bytes */
+	s++;
+	for (i = 1; i < usize; i++) {
+		*next_ret = s+1;
+		/* if byte is nul or is not a continuation byte, return unknown */
+		if (*s == '\0' || ((unsigned char)*s & utfmask[0]) != utfbyte[0])
+			return unknown;
+		/* 6 is the number of relevant bits in the continuation byte */
+		ucode = (ucode << 6) | ((unsigned char)*s & ~utfmask[0]);
+		s++;
+	}
+
+	/* check if ucode is invalid or in utf-16 surrogate halves */
+	if (!BETWEEN(ucode, utfmin[usize], utfmax[usize]) || BETWEEN (ucode, 0xD800, 0xDFFF))
+		return unknown;
+
+	return ucode;
+}
+
+/* get which font contains a given code point */
+static XftFont *
+getfontucode(FcChar32 ucode)
+{
+	FcCharSet *fccharset = NULL;
+	FcPattern *fcpattern = NULL;
+	FcPattern *match = NULL;
+	FcResult result;
+	XftFont *retfont = NULL;
+	size_t i;
+
+	/* search through the fonts supplied by the user for the first one supporting ucode */
+	for (i = 0; i < dc.nfonts; i++)
+		if (XftCharExists(dpy, dc.fonts[i], ucode) == FcTrue)
+			return dc.fonts[i];
+
+	/* if could not find a font in dc.fonts, search through system fonts */
+
+	/* create a charset containing our code point */
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, ucode);
+
+	/* create a pattern akin to the dc.pattern but containing our charset */
+	if (fccharset) {
+		fcpattern = FcPatternDuplicate(dc.pattern);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	}
+
+	/* find font matching fcpattern */
+	if (fcpattern) {
+		FcDefaultSubstitute(fcpattern);
+		FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+		match = FcFontMatch(NULL, fcpattern, &result);
+	}
+
+	/* if found a font, open it */
+	if (match && result == FcResultMatch) {
+		retfont = XftFontOpenPattern(dpy, match);
+		if (retfont && XftCharExists(dpy, retfont, ucode) == FcTrue) {
+			if ((dc.fonts = realloc(dc.fonts, dc.nfonts+1)) == NULL)
+				err(1, "realloc");
+			dc.fonts[dc.nfonts] = retfont;
+			return dc.fonts[dc.nfonts++];
+		} else {
+			XftFontClose(dpy, retfont);
+		}
+	}
+
+	/* in case no fount was found, return the first one */
+	return dc.fonts[0];
+}
+
+/* draw text into XftDraw, return width of text glyphs */
+static int
+drawtext(XftDraw *draw, XftColor *color, int x, int y, unsigned h, const char *text, size_t textlen)
+{
+	int textwidth = 0;
+	XftFont *currfont, *nextfont;
+	XGlyphInfo ext;
+	FcChar32 ucode;
+	const char *next, *tmp, *end;
+	size_t len = 0;
+
+	nextfont = dc.fonts[0];
+	end = text + textlen;
+	while ((!textlen || text < end) && *text) {
+		tmp = text;
+		do {
+			next = tmp;
+			currfont = nextfont;
+			ucode = getnextutf8char(next, &tmp);
+			nextfont = getfontucode(ucode);
+		} while ((!textlen || next < end) && *next && currfont == nextfont);
+		len = next - text;
+		XftTextExtentsUtf8(dpy, currfont, (XftChar8 *)text, len, &ext);
+		textwidth += ext.xOff;
+		if (draw) {
+			int texty;
+
+			texty = y + (h - (currfont->ascent + currfont->descent))/2 + currfont->ascent;
+			XftDrawStringUtf8(draw, color, currfont, x, texty, (XftChar8 *)text, len);
+			x += ext.xOff;
+		}
+		text = next;
+	}
+	return textwidth;
+}
+
+/* draw the text on input field, return position of the cursor */
+static void
+drawinput(struct Prompt *prompt, int copy)
+{
+	unsigned minpos, maxpos;
+	unsigned curpos;            /* where to draw the cursor */
+	int x, y, xtext;
+	int widthpre, widthsel, widthpos;
+
+	if (pflag)
+		return;
+
+	x = dc.pad;
+
+	minpos = MIN(prompt->cursor, prompt->select);
+	maxpos = MAX(prompt->cursor, prompt->select);
+
+	/* draw background */
+	XSetForeground(dpy, dc.gc, dc.normal[ColorBG].pixel);
+	XFillRectangle(dpy, prompt->pixmap, dc.gc, x, 0,
+	               prompt->w - x, prompt->h);
+
+	/* draw text before selection */
+	xtext = x;
+	widthpre = (minpos)
 	         ? drawtext(prompt->draw, &dc.normal[ColorFG], xtext, 0, prompt->h,
 	                    prompt->text, minpos)
 	         : 0;
@@ -636,19 +1628,22 @@ drawinput(struct Prompt *prompt, int copy)
 		          prompt->w - x, prompt->h, x, 0);
 }
 
-/* draw nth item in the item array */
+/* draw the listed items */
 static void
 drawitems(struct Prompt *prompt)
 {
-	struct Group *group;
+	struct Item item;
 	XftColor *color;
-	size_t i;
+	size_t i, pos;
+	uint32_t group;
 	int x, y;
 
-	group = NULL;
+	group = 0;
 	for (i = 0; i < prompt->nitems; i++) {
-		color = (prompt->itemarray[i] == prompt->selitem) ? dc.selected
-	      	      : (prompt->itemarray[i] == prompt->hoveritem) ? dc.hover
+		pos = prompt->matchlist + i;
+		getmatch(prompt, pos, &item);
+		color = (pos == prompt->selitem) ? dc.selected
+	      	      : (pos == prompt->hoveritem) ? dc.hover
 	      	      : dc.normal;
 		y = (i + 1) * prompt->h + prompt->separator;
 
@@ -658,22 +1653,31 @@ drawitems(struct Prompt *prompt)
 
 		/* draw item text */
 		x = dc.pad;
-		if (gflag) {
-			if (group != prompt->itemarray[i]->group) {
-				group = prompt->itemarray[i]->group;
+		if (gflag || Gflag) {
+			if (group != item.group) {
+				group = item.group;
 				if (group) {
-					drawtext(prompt->draw, &color[ColorCM], x, y, prompt->h, group->name, 0);
+					drawtext(prompt->draw, &color[ColorCM], x, y, prompt->h, item.groupname, 0);
 				}
 			}
 			x += GROUPWIDTH;
 		}
-		x += drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h, prompt->itemarray[i]->text, 0);
+		x += drawtext(prompt->draw, &color[ColorFG], x, y, prompt->h, item.text, item.textlen);
 		x += dc.pad;
 
-		/* if item has a description, draw it */
-		if (prompt->itemarray[i]->description != NULL) {
+		/* if item has a description, draw it; in the foreground color if the input matched it */
+		if (item.desclen > 0) {
+			x += drawtext(prompt->draw,
+			              &color[item.field == FieldDescription ? ColorFG : ColorCM],
+			              x, y, prompt->h,
+		         	      item.description, item.desclen);
+			x += dc.pad;
+		}
+
+		/* the output is only drawn if the input matched it, otherwise the match would not be visible */
+		if (item.field == FieldOutput && item.outlen > 0) {
 			drawtext(prompt->draw, &color[ColorCM], x, y, prompt->h,
-		         	 prompt->itemarray[i]->description, 0);
+		         	 item.output, item.outlen);
 		}
 	}
 }
@@ -688,14 +1692,17 @@ drawprompt(struct Prompt *prompt)
 	/* draw input field text and set position of the cursor */
 	drawinput(prompt, 0);
 
-	/* background of items */
-	y = prompt->h + prompt->separator;
-	h = prompt->h * prompt->maxitems;
-	XSetForeground(dpy, dc.gc, dc.normal[ColorBG].pixel);
-	XFillRectangle(dpy, prompt->pixmap, dc.gc, 0, y, prompt->w, h);
+	/* the items are drawn once they are matched against the input; until then, the ones drawn last are left */
+	if (!prompt->matching) {
+		/* background of items */
+		y = prompt->h + prompt->separator;
+		h = prompt->h * prompt->maxitems;
+		XSetForeground(dpy, dc.gc, dc.normal[ColorBG].pixel);
+		XFillRectangle(dpy, prompt->pixmap, dc.gc, 0, y, prompt->w, h);
 
-	/* draw items */
-	drawitems(prompt);
+		/* draw items */
+		drawitems(prompt);
+	}
 
 	/* commit drawing */
 	h = prompt->h * (prompt->maxitems + 1) + prompt->separator;
@@ -952,6 +1959,12 @@ setpromptinput(struct Prompt *prompt)
 	prompt->text = emalloc(INPUTSIZ);
 	prompt->textsize = INPUTSIZ;
 	prompt->text[0] = '\0';
+	prompt->matchtext = emalloc(INPUTSIZ);
+	prompt->matchtext[0] = '\0';
+	prompt->stale = 0;
+	prompt->posttext = emalloc(INPUTSIZ);
+	prompt->postgen = prompt->listgen = 0;
+	prompt->matching = 0;
 	prompt->cursor = 0;
 	prompt->select = 0;
 	prompt->file = 0;
@@ -972,20 +1985,144 @@ setpromptundo(struct Prompt *prompt)
 	prompt->undocurr = NULL;
 }
 
-/* allocate memory for the item list displayed when completion is active */
+/* initialize the list of items, which can be read before the number of items displayed is known */
 static void
 setpromptitems(struct Prompt *prompt)
 {
-	prompt->groups = NULL;
-	prompt->head = prompt->tail = NULL;
-	prompt->fhead = prompt->ftail = NULL;
-	prompt->firstmatch = NULL;
-	prompt->selitem = NULL;
-	prompt->hoveritem = NULL;
-	prompt->matchlist = NULL;
+	memset(&prompt->arena, 0, sizeof(prompt->arena));
+	prompt->arenadead = 0;
+	memset(&prompt->files, 0, sizeof(prompt->files));
+	memset(&prompt->items, 0, sizeof(prompt->items));
+	memset(&prompt->fitems, 0, sizeof(prompt->fitems));
+	memset(prompt->matches, 0, sizeof(prompt->matches));
+	prompt->scanned = 0;
+	memset(&prompt->index, 0, sizeof(prompt->index));
+	prompt->index.gen = SIZE_MAX;   /* not the generation of the first items, so they are indexed from the start */
+	prompt->maxranks = zflag ? RANKSIZ : 0;
+	prompt->ranks = zflag ? emalloc(prompt->maxranks * sizeof(*prompt->ranks)) : NULL;
+	prompt->nranks = 0;
+	prompt->memos = NULL;
+	prompt->memosize = 0;
+	prompt->itemgen = 0;
+	prompt->selitem = NOITEM;
+	prompt->hoveritem = NOITEM;
+	prompt->matchlist = 0;
+	prompt->maxitems = 0;
+	prompt->nitems = 0;
+	prompt->sources = NULL;
+	prompt->query = NULL;
+	prompt->pending = 0;
+	prompt->uniq = NULL;
+	prompt->uniqsize = prompt->nuniq = 0;
+}
+
+/* set the number of items listed when completion is active */
+static void
+setpromptarray(struct Prompt *prompt)
+{
 	prompt->maxitems = config.number_items;
 	prompt->nitems = 0;
-	prompt->itemarray = ecalloc(prompt->maxitems, sizeof *prompt->itemarray);
+}
+
+/* add a source reading items from fd; map it if it is a regular file, otherwise open the file it is spooled into */
+static struct Source *
+addsource(struct Prompt *prompt, const char *name, int fd)
+{
+	struct Source *src, **p;
+	struct stat sb;
+	const char *tmpdir;
+	char path[PATH_MAX];
+	char *buf;
+	off_t off;
+
+	src = emalloc(sizeof(*src));
+	src->next = NULL;
+	src->name = name;
+	src->running = 0;
+	src->chunks = NULL;
+	src->buf = NULL;
+	src->pos = src->len = src->size = 0;
+	src->map = 0;
+	src->spoolfd = -1;
+	src->spoolsize = 0;
+	src->setgroup = 1;
+	src->eof = 0;
+	src->group = 0;
+	src->watch = 0;
+	src->wfd = -1;
+	src->pid = 0;
+	src->cache = 0;
+	src->file = NULL;
+	src->image = NULL;
+	src->imagesize = 0;
+	src->cachefp = NULL;
+	src->cachetmp = NULL;
+	src->fd = fd;
+	for (p = &prompt->sources; *p; p = &(*p)->next)
+		;
+	*p = src;
+
+	/* with -G, items are in a group named after their source */
+	if (Gflag) {
+		src->group = interngroup(&prompt->items, &prompt->arena, name, strlen(name));
+	}
+
+	/* a watched file can change under a mapping, so it is read anew each time it changes */
+	if (fstat(src->fd, &sb) != -1 && S_ISREG(sb.st_mode) && wflag) {
+		src->watch = 1;
+		return src;
+	}
+
+	/* items point into the mapping, so the input is never copied */
+	if (fstat(src->fd, &sb) != -1 && S_ISREG(sb.st_mode) && (uintmax_t)sb.st_size <= SIZE_MAX) {
+		if ((off = lseek(src->fd, 0, SEEK_CUR)) == -1)
+			off = 0;
+		if (off < sb.st_size &&
+		    (buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, src->fd, 0)) != MAP_FAILED) {
+			addchunk(src, buf, sb.st_size, -1);
+			src->buf = buf;
+			src->pos = off;
+			src->len = src->size = sb.st_size;
+			src->map = 1;
+			src->file = buf;
+
+			/* only the items of the first source are cached, as the image is of one file */
+			if (cachefile != NULL && p == &prompt->sources) {
+				src->cache = 1;
+				memset(&src->cachehdr, 0, sizeof(src->cachehdr));
+				memcpy(src->cachehdr.magic, CACHEMAGIC, sizeof(src->cachehdr.magic));
+				src->cachehdr.dev = sb.st_dev;
+				src->cachehdr.ino = sb.st_ino;
+				src->cachehdr.size = sb.st_size;
+				src->cachehdr.mtime = sb.st_mtim.tv_sec;
+				src->cachehdr.mtimensec = sb.st_mtim.tv_nsec;
+				src->cachehdr.pos = off;
+				src->cachehdr.flags = gflag | Pflag << 1;
+			}
+			return src;
+		}
+	}
+
+	/* the spool file is unlinked right away, it goes away when we exit */
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+		tmpdir = "/tmp";
+	snprintf(path, sizeof(path), "%s/xfilter.XXXXXXXX", tmpdir);
+	if ((src->spoolfd = mkostemp(path, O_CLOEXEC)) != -1)
+		unlink(path);
+	return src;
+}
+
+/* open file to read items from, "-" for stdin */
+static void
+opensource(struct Prompt *prompt, const char *name)
+{
+	int fd;
+
+	if (strcmp(name, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(name, O_RDONLY | O_CLOEXEC)) == -1)
+		err(1, "%s", name);
+	addsource(prompt, name, fd);
 }
 
 /* calculate prompt geometry */
@@ -1125,7 +2262,7 @@ setprompthist(struct Prompt *prompt, const char *histfile)
 	prompt->histsize = 0;
 
 	if (histfile != NULL && *histfile != '\0') {
-		if ((prompt->histfp = fopen(histfile, "a+")) == NULL)
+		if ((prompt->histfp = fopen(histfile, "a+e")) == NULL)
 			warn("%s", histfile);
 		else {
 			loadhist(prompt->histfp, prompt);
@@ -1325,16 +2462,14 @@ navhist(struct Prompt *prompt, int direction)
 static void
 getfilelist(struct Prompt *prompt)
 {
-	struct Item *item;
+	struct Coder coder;
 	struct dirent *entry;
+	const char *name;
 	DIR *dirp;
 	char path[PATH_MAX];
 
-	if (prompt->tail != NULL)
-		prompt->tail->next = NULL;
-	else
-		prompt->head = NULL;
-	prompt->fhead = prompt->ftail = NULL;
+	cleartable(&prompt->fitems);
+	memset(&coder, 0, sizeof(coder));
 	if (prompt->text[0] == '/' || prompt->text[0] == '.')
 		snprintf(path, sizeof(path), "%s", prompt->text);
 	else
@@ -1343,656 +2478,3543 @@ getfilelist(struct Prompt *prompt)
 		while ((entry = readdir(dirp)) != NULL) {
 			if (entry->d_name[0] == '.')
 				continue;
-			if (*prompt->text != '\0') {
+			if (*prompt->text != '\0')
 				snprintf(path, sizeof(path), "%s/%s", prompt->text, entry->d_name);
-				item = allocitem(path, NULL, NULL, NULL);
+			else
+				snprintf(path, sizeof(path), "%s", entry->d_name);
+
+			/* with -P, the paths share the directory with the one before them */
+			if (Pflag) {
+				name = encodeline(&coder, &prompt->files, path, strlen(path));
+				additem(&prompt->fitems, coder.block, name, strlen(path), 0);
 			} else {
-				item = allocitem(entry->d_name, NULL, NULL, NULL);
+				name = allocfilename(&prompt->files, path);
+				additem(&prompt->fitems, NULL, name, strlen(name), 0);
 			}
-			if (prompt->fhead == NULL)
-				prompt->fhead = item;
-			if (prompt->ftail != NULL)
-				prompt->ftail->next = item;
-			item->prev = prompt->ftail;
-			prompt->ftail = item;
 		}
 		closedir(dirp);
 	}
-	if (prompt->fhead != NULL) {
-		if (prompt->tail != NULL) {
-			prompt->tail->next = prompt->fhead;
-			prompt->fhead->prev = prompt->tail;
-		} else {
-			prompt->head = prompt->fhead;
-		}
+	free(coder.prev);
+}
+
+/* get the given field of the item */
+static const char *
+itemfield(struct Item *item, enum Field field, size_t *len)
+{
+	switch (field) {
+	case FieldDescription:
+		*len = item->desclen;
+		return item->description;
+	case FieldOutput:
+		*len = item->outlen;
+		return item->output;
+	default:
+		*len = item->textlen;
+		return item->text;
 	}
 }
 
-/* check whether item matches text */
+/* check whether the bytes a and b are the same, as the input is matched */
 static int
-itemmatch(struct Item *item, const char *text, size_t textlen, int middle)
+samebyte(unsigned char a, unsigned char b)
 {
-	const char *s;
+	return iflag ? tolower(a) == tolower(b) : a == b;
+}
 
-	s = item->text;
-	while (*s) {
-		if ((*fstrncmp)(s, text, textlen) == 0)
-			return 1;
-		if (middle) {
+/* find the first byte from s up to end that is the same as c; return NULL if there is none */
+static const char *
+findbyte(const char *s, const char *end, unsigned char c)
+{
+	if (!iflag)
+		return memchr(s, c, end - s);
+	for (; s < end; s++)
+		if (samebyte(*s, c))
+			return s;
+	return NULL;
+}
+
+/* get the two bytes that are the same as c, as the input is matched */
+static void
+bytecases(unsigned char c, unsigned char *a, unsigned char *b)
+{
+	*a = iflag ? tolower(c) : c;
+	*b = iflag ? toupper(c) : c;
+}
+
+/* check whether text, of length textlen, is at s; its first and last bytes are known to be there */
+static int
+strat(const char *s, const char *text, size_t textlen)
+{
+	if (iflag)
+		return (*fstrncmp)(s, text, textlen) == 0;
+	return textlen <= 2 || memcmp(s + 1, text + 1, textlen - 2) == 0;
+}
+
+/* find text, of length textlen, in the string s of length len, a byte at a time; return NULL if it is not there */
+static const char *
+findstrbytes(const char *s, size_t len, const char *text, size_t textlen)
+{
+	const char *end;
+	unsigned char a, b, c;
+
+	if (textlen == 0)
+		return s;
+	if (len < textlen)
+		return NULL;
+	end = s + len - textlen + 1;
+	if (!iflag) {
+		while ((s = memchr(s, text[0], end - s)) != NULL) {
+			if (memcmp(s, text, textlen) == 0)
+				return s;
 			s++;
-		} else {
-			while (*s && isspace(*(unsigned char *)s))
-				s++;
-			while (*s && !isspace(*(unsigned char *)s))
-				s++;
 		}
+		return NULL;
+	}
+	bytecases(text[0], &a, &b);
+	for (; s < end; s++) {
+		c = *s;
+		if ((c == a || c == b) && (*fstrncmp)(s, text, textlen) == 0)
+			return s;
 	}
+	return NULL;
+}
 
-	return 0;
+#ifdef X86SIMD
+/*
+ * find text, of length textlen, in the string s of length len, 16
+ * positions at a time; return NULL if it is not there.  Only the
+ * positions where both the first and the last byte of text are found
+ * are compared with it.
+ */
+__attribute__((target("sse2")))
+static const char *
+findstrsse2(const char *s, size_t len, const char *text, size_t textlen)
+{
+	__m128i fa, fb, la, lb, f, l;
+	unsigned char a, b, c, d;
+	unsigned mask;
+	size_t i;
+
+	if (textlen == 0 || len < textlen + 15)
+		return findstrbytes(s, len, text, textlen);
+	bytecases(text[0], &a, &b);
+	bytecases(text[textlen - 1], &c, &d);
+	fa = _mm_set1_epi8(a);
+	fb = _mm_set1_epi8(b);
+	la = _mm_set1_epi8(c);
+	lb = _mm_set1_epi8(d);
+	for (i = 0; i + textlen + 15 <= len; i += 16) {
+		f = _mm_loadu_si128((const __m128i *)(s + i));
+		l = _mm_loadu_si128((const __m128i *)(s + i + textlen - 1));
+		f = _mm_or_si128(_mm_cmpeq_epi8(f, fa), _mm_cmpeq_epi8(f, fb));
+		l = _mm_or_si128(_mm_cmpeq_epi8(l, la), _mm_cmpeq_epi8(l, lb));
+		for (mask = _mm_movemask_epi8(_mm_and_si128(f, l)); mask != 0; mask &= mask - 1)
+			if (strat(s + i + __builtin_ctz(mask), text, textlen))
+				return s + i + __builtin_ctz(mask);
+	}
+	return findstrbytes(s + i, len - i, text, textlen);
 }
 
-/* free a item tree */
-static void
-cleanitem(struct Item *root)
+/* find text, of length textlen, in the string s of length len, 32 positions at a time; return NULL if it is not there */
+__attribute__((target("avx2")))
+static const char *
+findstravx2(const char *s, size_t len, const char *text, size_t textlen)
 {
-	struct Item *item, *tmp;
+	__m256i fa, fb, la, lb, f, l;
+	unsigned char a, b, c, d;
+	unsigned mask;
+	size_t i;
 
-	item = root;
-	while (item != NULL) {
-		tmp = item;
-		item = item->next;
-		free(tmp->text);
-		free(tmp->description);
-		free(tmp->output);
-		free(tmp);
+	if (textlen == 0 || len < textlen + 31)
+		return findstrsse2(s, len, text, textlen);
+	bytecases(text[0], &a, &b);
+	bytecases(text[textlen - 1], &c, &d);
+	fa = _mm256_set1_epi8(a);
+	fb = _mm256_set1_epi8(b);
+	la = _mm256_set1_epi8(c);
+	lb = _mm256_set1_epi8(d);
+	for (i = 0; i + textlen + 31 <= len; i += 32) {
+		f = _mm256_loadu_si256((const __m256i *)(s + i));
+		l = _mm256_loadu_si256((const __m256i *)(s + i + textlen - 1));
+		f = _mm256_or_si256(_mm256_cmpeq_epi8(f, fa), _mm256_cmpeq_epi8(f, fb));
+		l = _mm256_or_si256(_mm256_cmpeq_epi8(l, la), _mm256_cmpeq_epi8(l, lb));
+		for (mask = _mm256_movemask_epi8(_mm256_and_si256(f, l)); mask != 0; mask &= mask - 1)
+			if (strat(s + i + __builtin_ctz(mask), text, textlen))
+				return s + i + __builtin_ctz(mask);
 	}
+	return findstrsse2(s + i, len - i, text, textlen);
 }
+#endif
 
-/* create list of matching items */
+/* pick the substring search for the processor */
 static void
-getmatchlist(struct Prompt *prompt)
+initsearch(void)
 {
-	struct Item *retitem = NULL;
-	struct Item *previtem = NULL;
-	struct Item *item = NULL;
-	size_t beg, len;
-	const char *text;
+	findstr = findstrbytes;
+#ifdef X86SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		findstr = findstravx2;
+	else if (__builtin_cpu_supports("sse2"))
+		findstr = findstrsse2;
+#endif
+}
 
-	beg = 0;
-	len = strlen(prompt->text);
-	text = prompt->text + beg;
+/* check whether text is a subsequence of the string s of length len */
+static int
+fuzzymatch(const char *s, size_t len, const char *text, size_t textlen)
+{
+	const char *end;
+	size_t i;
 
-	/* build list of matched items using the .nextmatch and .prevmatch pointers */
-	for (item = prompt->head; item; item = item->next) {
-		if (itemmatch(item, text, len, 0)) {
-			if (!retitem)
-				retitem = item;
-			item->prevmatch = previtem;
-			if (previtem)
-				previtem->nextmatch = item;
-			previtem = item;
-		}
+	end = s + len;
+	for (i = 0; i < textlen; i++) {
+		if ((s = findbyte(s, end, text[i])) == NULL)
+			return 0;
+		s++;
 	}
-	/* now search for items that match in the middle of the item */
-	for (item = prompt->head; item; item = item->next) {
-		if (!itemmatch(item, text, len, 0) && itemmatch(item, text, len, 1)) {
-			if (!retitem)
-				retitem = item;
-			item->prevmatch = previtem;
-			if (previtem)
-				previtem->nextmatch = item;
-			previtem = item;
+	return 1;
+}
+
+/* check whether the byte at p of the string s begins a word */
+static int
+wordstart(const char *s, const char *p)
+{
+	unsigned char c, prev;
+
+	if (p == s)
+		return 1;
+	c = *p;
+	prev = p[-1];
+	if (prev >= 0x80)
+		return 0;
+	return !isalnum(prev) || (islower(prev) && isupper(c));
+}
+
+/*
+ * score how well text, of length textlen, matches the string s of
+ * length len as a subsequence; the higher, the better.  The shortest
+ * stretch of s ending where text is first found in it is scored, so
+ * this takes a couple of passes over s rather than trying every way
+ * the bytes of text could be found.
+ */
+static int
+fuzzyscore(const char *s, size_t len, const char *text, size_t textlen)
+{
+	const char *beg, *end, *p;
+	size_t i;
+	int score, next;
+
+	if (textlen == 0)
+		return 0;
+	end = s + len;
+	for (p = s, i = 0; i < textlen; i++, p++)
+		if ((p = findbyte(p, end, text[i])) == NULL)
+			return 0;
+	end = p;
+	for (i = textlen; i > 0; i--)
+		while (!samebyte(*--p, text[i - 1]))
+			;
+	beg = p;
+
+	/* bytes found at the beginning of words or right after each other score more, bytes in between score less */
+	score = -MIN(beg - s, 16);
+	next = 0;
+	for (i = 0; p < end && i < textlen; p++) {
+		if (!samebyte(*p, text[i])) {
+			score--;
+			next = 0;
+			continue;
 		}
+		score += 16;
+		if (wordstart(s, p))
+			score += (i == 0) ? 16 : 8;
+		if (next)
+			score += 8;
+		next = 1;
+		i++;
 	}
-	if (previtem)
-		previtem->nextmatch = NULL;
-
-	prompt->firstmatch = retitem;
-	prompt->matchlist = retitem;
-	prompt->selitem = NULL;
+	return score;
 }
 
-/* navigate through the list of matching items; and fill item array */
-static void
-navmatchlist(struct Prompt *prompt, int direction)
+/* check whether the string s of length len matches text */
+static int
+strmatch(const char *s, size_t len, const char *text, size_t textlen, int middle)
 {
-	struct Item *item;
-	size_t i, selnum;
+	const char *end;
+
+	/* a fuzzy match in the middle of words is a match as a subsequence */
+	if (middle && zflag)
+		return fuzzymatch(s, len, text, textlen);
+	if (middle)
+		return (*findstr)(s, len, text, textlen) != NULL;
+	end = s + len;
+	while (s < end) {
+		if ((size_t)(end - s) < textlen)
+			break;
+		if ((*fstrncmp)(s, text, textlen) == 0)
+			return 1;
+		while (s < end && isspace(*(unsigned char *)s))
+			s++;
+		while (s < end && !isspace(*(unsigned char *)s))
+			s++;
+	}
 
-	if (direction != 0 && prompt->selitem == NULL) {
-		prompt->selitem = prompt->matchlist;
-		goto done;
+	return 0;
+}
+
+/*
+ * check whether the item whose text is s, of length len, matches text;
+ * return the first matched field, or FieldLast if no field matches.
+ * The fields of an item are next to each other in the input, so
+ * checking several fields does not touch more memory than the bytes
+ * compared.
+ */
+static enum Field
+itemmatch(const char *s, size_t len, const char *text, size_t textlen, int middle)
+{
+	struct Item item;
+	const char *field;
+	enum Field i;
+	size_t fieldlen;
+
+	/* everything matches an empty input, but no field in particular */
+	if (textlen == 0)
+		return FieldText;
+	item.text = s;
+	item.textlen = len;
+	item.description = item.output = NULL;
+	if (matchfields & ~(1 << FieldText))
+		splititem(&item);
+	for (i = 0; i < FieldLast; i++) {
+		if (!(matchfields & (1 << i)))
+			continue;
+		field = itemfield(&item, i, &fieldlen);
+		if (field != NULL && strmatch(field, fieldlen, text, textlen, middle))
+			return i;
 	}
-	if (!prompt->selitem)
-		goto done;
-	if (direction > 0 && prompt->selitem->nextmatch) {
-		prompt->selitem = prompt->selitem->nextmatch;
-		for (selnum = 0, item = prompt->matchlist; 
-		     selnum < prompt->maxitems && item != prompt->selitem->prevmatch;
-		     selnum++, item = item->nextmatch)
-			;
-		if (selnum + 1 >= prompt->maxitems) {
-			for (i = 0, item = prompt->matchlist;
-			     i < prompt->maxitems && item;
-			     i++, item = item->nextmatch)
-				;
-			prompt->matchlist = (item) ? item : prompt->selitem;
-		}
-	} else if (direction < 0 && prompt->selitem->prevmatch) {
-		prompt->selitem = prompt->selitem->prevmatch;
-		if (prompt->selitem == prompt->matchlist->prevmatch) {
-			for (i = 0, item = prompt->matchlist;
-			     i < prompt->maxitems && item;
-			     i++, item = item->prevmatch)
-				;
-			prompt->matchlist = (item) ? item : prompt->firstmatch;
-		}
+	return FieldLast;
+}
+
+/* append item i to the list of matching items of a class */
+static void
+addmatch(struct Matches *matches, size_t i)
+{
+	if (matches->n == matches->size) {
+		matches->size = matches->size ? matches->size * 2 : 1024;
+		matches->items = erealloc(matches->items, matches->size * sizeof(*matches->items));
 	}
+	matches->items[matches->n++] = i;
+}
 
-done:
-	/* fill .itemarray */
-	for (i = 0, item = prompt->matchlist;
-	     i < prompt->maxitems && item;
-	     i++, item = item->nextmatch)
-		prompt->itemarray[i] = item;
-	prompt->nitems = i;
+/*
+ * get how item i of table, in run, matches text of length len, given
+ * its text or its coded line s, which is decoded with dec; only in the
+ * middle of words if middle is set
+ */
+static unsigned char
+testitem(struct Table *table, struct Run *run, size_t i, const char *s, const char *text, size_t len, int middle, struct Decoder *dec)
+{
+	enum Field field;
+
+	if (len > 0 && run->coded)
+		s = decodeline(dec, run->base, s);
+	if (!middle && (field = itemmatch(s, table->len[i], text, len, 0)) != FieldLast)
+		return field | MATCHPREFIX;
+	return itemmatch(s, table->len[i], text, len, 1);
 }
 
-/* get Ctrl input operation */
-static enum Ctrl
-getoperation(KeySym ksym, unsigned state)
+/* get the class of the items of table that matched the input as match says */
+static enum Class
+matchclass(struct Prompt *prompt, struct Table *table, unsigned char match)
 {
-	switch (ksym) {
-	case XK_Escape:         return CTRLCANCEL;
-	case XK_Return:         return CTRLENTER;
-	case XK_KP_Enter:       return CTRLENTER;
-	case XK_ISO_Left_Tab:   return CTRLPREV;
-	case XK_Tab:            return CTRLNEXT;
-	case XK_Prior:          return CTRLPGUP;
-	case XK_Next:           return CTRLPGDOWN;
-	case XK_BackSpace:      return CTRLDELLEFT;
-	case XK_Delete:         return CTRLDELRIGHT;
-	case XK_Up:             return CTRLUP;
-	case XK_Down:           return CTRLDOWN;
-	case XK_Home:
-		if (state & ShiftMask)
-			return CTRLSELBOL;
-		return CTRLBOL;
-	case XK_End:
-		if (state & ShiftMask)
-			return CTRLSELEOL;
-		return CTRLEOL;
-	case XK_Left:
-		if (state & ShiftMask && state & ControlMask)
-			return CTRLSELWLEFT;
-		if (state & ShiftMask)
-			return CTRLSELLEFT;
-		if (state & ControlMask)
-			return CTRLWLEFT;
-		return CTRLLEFT;
-	case XK_Right:
-		if (state & ShiftMask && state & ControlMask)
-			return CTRLSELWRIGHT;
-		if (state & ShiftMask)
-			return CTRLSELRIGHT;
-		if (state & ControlMask)
-			return CTRLWRIGHT;
-		return CTRLRIGHT;
+	if (table == &prompt->fitems)
+		return (match & MATCHPREFIX) ? ClassFilePrefix : ClassFileMiddle;
+	return (match & MATCHPREFIX) ? ClassPrefix : ClassMiddle;
+}
+
+/* get the number of items that match the input */
+static size_t
+nmatches(struct Prompt *prompt)
+{
+	enum Class c;
+	size_t n;
+
+	n = 0;
+	for (c = 0; c < ClassLast; c++)
+		n += prompt->matches[c].n;
+	return n;
+}
+
+/* append the n items at items to the list of matching items of a class */
+static void
+addmatches(struct Matches *matches, const uint32_t *items, size_t n)
+{
+	if (matches->n + n > matches->size) {
+		matches->size = MAX(matches->n + n, 2 * matches->size);
+		matches->items = erealloc(matches->items, matches->size * sizeof(*matches->items));
 	}
+	memcpy(matches->items + matches->n, items, n * sizeof(*items));
+	matches->n += n;
+}
 
-	/* handle Ctrl + Letter combinations */
-	if (state & ControlMask && ((ksym >= XK_a && ksym <= XK_z) || (ksym >= XK_A && ksym <= XK_Z))) {
-		if (state & ShiftMask) {
-			switch (ksym) {
-			case XK_A: case XK_a:   return CTRLSELBOL;
-			case XK_E: case XK_e:   return CTRLSELEOL;
-			case XK_B: case XK_b:   return CTRLSELLEFT;
-			case XK_F: case XK_f:   return CTRLSELRIGHT;
-			case XK_Z: case XK_z:   return CTRLREDO;
-			}
-		} else {
-			switch (ksym) {
-			case XK_a:              return CTRLBOL;
-			case XK_b:              return CTRLLEFT;
-			case XK_c:              return CTRLCOPY;
-			case XK_d:              return CTRLDELRIGHT;
-			case XK_e:              return CTRLEOL;
-			case XK_f:              return CTRLRIGHT;
-			case XK_h:              return CTRLDELLEFT;
-			case XK_k:              return CTRLDELEOL;
-			case XK_m:              return CTRLENTER;
-			case XK_n:              return CTRLNEXT;
-			case XK_p:              return CTRLPREV;
-			case XK_u:              return CTRLDELBOL;
-			case XK_v:              return CTRLPASTE;
-			case XK_w:              return CTRLDELWORD;
-			case XK_z:              return CTRLUNDO;
-			}
+/* match the items of slice c of the job against its input, decoding the coded ones with dec */
+static void
+matchslice(size_t c, struct Decoder *dec)
+{
+	struct Slice *slice;
+	struct Table *table;
+	struct Run *run, *last;
+	size_t p, end, k;
+	unsigned char match;
+	int skip;
+
+	slice = &job.slices[c];
+	slice->prefix.n = slice->middle.n = 0;
+	table = job.table;
+	end = MIN(job.n, (c + 1) * MATCHSIZ);
+	run = last = NULL;
+	skip = 0;
+	for (p = c * MATCHSIZ; p < end; p++) {
+		k = (job.items != NULL) ? job.items[p] : job.first + p;
+		run = (run == NULL) ? itemrun(table, k) : seekrun(table, run, k);
+
+		/* the lines of a block whose filter rules out the input are not decoded */
+		if (run != last)
+			skip = run->coded && !filtermatch(run->base, job.text, job.len);
+		last = run;
+		if (skip) {
+			table->match[k] = FieldLast;
+			continue;
 		}
-		return CTRLNOTHING;
+		match = testitem(table, run, k, run->base + table->off[k], job.text, job.len, job.middle, dec);
+		table->match[k] = match;
+		if (match & MATCHPREFIX)
+			addmatch(&slice->prefix, k);
+		else if (match != FieldLast)
+			addmatch(&slice->middle, k);
 	}
+}
 
-	return INSERT;
+/* match the slices of the job left, until there are none; called with joblock held */
+static void
+matchslices(struct Decoder *dec)
+{
+	size_t c;
+
+	while (job.next < job.nslices) {
+		/* the slices not taken yet are dropped when the job is cancelled */
+		if (job.cancel) {
+			job.nslices = job.next;
+			if (job.done == job.nslices)
+				pthread_cond_signal(&jobdone);
+			break;
+		}
+		c = job.next++;
+		pthread_mutex_unlock(&joblock);
+		matchslice(c, dec);
+		pthread_mutex_lock(&joblock);
+		if (++job.done == job.nslices)
+			pthread_cond_signal(&jobdone);
+	}
 }
 
-/* copy entry from undo list into text */
+/* match the slices of the jobs posted by the event loop */
+static void *
+matchthread(void *arg)
+{
+	struct Decoder dec;
+	size_t gen;
+
+	(void)arg;
+	memset(&dec, 0, sizeof(dec));
+	pthread_mutex_lock(&joblock);
+	for (gen = job.gen; !job.quit; gen = job.gen) {
+		/* the line decoded last may have been freed since the last job */
+		dec.block = NULL;
+		matchslices(&dec);
+		while (job.gen == gen && !job.quit)
+			pthread_cond_wait(&jobposted, &joblock);
+	}
+	pthread_mutex_unlock(&joblock);
+	free(dec.buf);
+	return NULL;
+}
+
+/*
+ * match against text, of length len, the n items of table listed in
+ * items, or from first on if items is NULL, and append the matching
+ * ones to prefix, if they matched at a word boundary, or to middle;
+ * with middle set, they are only matched in the middle of words.
+ * Many items are split in slices, matched by the matching threads and
+ * the event loop, whichever takes them first; the slices are appended
+ * in order once they are all matched, so prefix and middle may be the
+ * lists the items are taken from.  If the job is cancelled, they are
+ * left as they are, but the items matched are not.
+ */
 static void
-undo(struct Prompt *prompt)
+testitems(struct Table *table, const uint32_t *items, size_t first, size_t n,
+          const char *text, size_t len, int inmiddle, struct Matches *prefix, struct Matches *middle)
 {
-	if (prompt->undocurr) {
-		if (prompt->undocurr->text == NULL) {
-			return;
+	size_t c, i;
+
+	pthread_mutex_lock(&joblock);
+	job.table = table;
+	job.items = items;
+	job.first = first;
+	job.n = n;
+	job.text = text;
+	job.len = len;
+	job.middle = inmiddle;
+	job.nslices = (n + MATCHSIZ - 1) / MATCHSIZ;
+	job.next = job.done = 0;
+	if (job.nslices > job.slicesize) {
+		job.slices = erealloc(job.slices, job.nslices * sizeof(*job.slices));
+		memset(job.slices + job.slicesize, 0, (job.nslices - job.slicesize) * sizeof(*job.slices));
+		job.slicesize = job.nslices;
+	}
+
+	/* the threads are only woken up when there is more than a slice to match */
+	if (job.nslices > 1 && nthreads > 1) {
+		if (matchers == NULL) {
+			matchers = ecalloc(nthreads - 1, sizeof(*matchers));
+			for (i = 0; i < nthreads - 1; i++)
+				if (pthread_create(&matchers[nmatchers], NULL, matchthread, NULL) == 0)
+					nmatchers++;
 		}
-		if (strcmp(prompt->undocurr->text, prompt->text) == 0)
-			prompt->undocurr = prompt->undocurr->next;
+		job.gen++;
+		pthread_cond_broadcast(&jobposted);
 	}
-	if (prompt->undocurr) {
-		insert(prompt, NULL, 0 - prompt->cursor);
-		insert(prompt, prompt->undocurr->text, strlen(prompt->undocurr->text));
-		prompt->undocurr = prompt->undocurr->next;
+	matchslices(&table->dec);
+	while (job.done < job.nslices)
+		pthread_cond_wait(&jobdone, &joblock);
+	if (job.cancel) {
+		pthread_mutex_unlock(&joblock);
+		return;
+	}
+	pthread_mutex_unlock(&joblock);
+
+	if (items != NULL && prefix->items == items)
+		prefix->n = 0;
+	if (items != NULL && middle->items == items)
+		middle->n = 0;
+	for (c = 0; c < job.nslices; c++) {
+		addmatches(prefix, job.slices[c].prefix.items, job.slices[c].prefix.n);
+		addmatches(middle, job.slices[c].middle.items, job.slices[c].middle.n);
 	}
 }
 
-/* copy entry from undo list into text */
+/* check whether matching against the input was cancelled, as a newer input was posted */
+static int
+jobcancelled(void)
+{
+	int cancel;
+
+	pthread_mutex_lock(&joblock);
+	cancel = job.cancel;
+	pthread_mutex_unlock(&joblock);
+	return cancel;
+}
+
+/* stop the matching threads and the thread listing the matching items */
 static void
-redo(struct Prompt *prompt)
+cleanmatchers(void)
 {
-	if (prompt->undocurr && prompt->undocurr->prev)
-		prompt->undocurr = prompt->undocurr->prev;
-	if (prompt->undocurr && prompt->undocurr->prev && strcmp(prompt->undocurr->text, prompt->text) == 0)
-		prompt->undocurr = prompt->undocurr->prev;
-	if (prompt->undocurr) {
-		insert(prompt, NULL, 0 - prompt->cursor);
-		insert(prompt, prompt->undocurr->text, strlen(prompt->undocurr->text));
+	size_t i;
+
+	pthread_mutex_lock(&joblock);
+	job.quit = 1;
+	job.cancel = 1;
+	pthread_cond_broadcast(&jobposted);
+	pthread_cond_signal(&inputposted);
+	pthread_mutex_unlock(&joblock);
+	if (listpipe[0] != -1) {
+		pthread_join(lister, NULL);
+		close(listpipe[0]);
+		close(listpipe[1]);
 	}
+	for (i = 0; i < nmatchers; i++)
+		pthread_join(matchers[i], NULL);
+	for (i = 0; i < job.slicesize; i++) {
+		free(job.slices[i].prefix.items);
+		free(job.slices[i].middle.items);
+	}
+	free(job.slices);
+	free(matchers);
 }
 
-/* print typed string */
+/* get the key of the trigram at s, as it is matched */
+static uint32_t
+trigramkey(const char *s)
+{
+	unsigned char a, b, c;
+
+	a = iflag ? tolower((unsigned char)s[0]) : (unsigned char)s[0];
+	b = iflag ? tolower((unsigned char)s[1]) : (unsigned char)s[1];
+	c = iflag ? tolower((unsigned char)s[2]) : (unsigned char)s[2];
+	return (1 << 24) | (a << 16) | (b << 8) | c;
+}
+
+/* get the slot of the posting of a trigram key in the index, which is free if the trigram is not there */
+static struct Posting *
+findposting(struct Index *index, uint32_t key)
+{
+	size_t h;
+
+	for (h = (key * 2654435761u) & (index->nslots - 1); ; h = (h + 1) & (index->nslots - 1))
+		if (index->slots[h].key == key || index->slots[h].key == 0)
+			return &index->slots[h];
+}
+
+/* add item i to the posting of each trigram of the string s of length len */
 static void
-print(struct Prompt *prompt)
+indextrigrams(struct Index *index, size_t i, const char *s, size_t len)
 {
-	if (prompt->selitem != NULL) {
-		if (prompt->selitem->group != NULL) {
-			printf("%s\t", prompt->selitem->group->name);
+	struct Posting *slots, *posting;
+	uint32_t key;
+	size_t nslots, j;
+
+	for (j = 0; j + 3 <= len; j++) {
+		/* the table is grown to keep it at most half full */
+		if (2 * (index->nkeys + 1) > index->nslots) {
+			slots = index->slots;
+			nslots = index->nslots;
+			index->nslots = nslots ? 2 * nslots : 4096;
+			index->slots = ecalloc(index->nslots, sizeof(*index->slots));
+			for (; nslots > 0; nslots--)
+				if (slots[nslots - 1].key != 0)
+					*findposting(index, slots[nslots - 1].key) = slots[nslots - 1];
+			free(slots);
 		}
-		if (prompt->selitem->output != NULL) {
-			printf("%s\n", prompt->selitem->output);
-		} else {
-			printf("%s\n", prompt->selitem->text);
+		key = trigramkey(s + j);
+		posting = findposting(index, key);
+		if (posting->key == 0) {
+			posting->key = key;
+			index->nkeys++;
 		}
-	} else {
-		printf("%s\n", prompt->text);
+		if (posting->n > 0 && posting->items[posting->n - 1] == i)
+			continue;
+		if (posting->n == posting->size) {
+			posting->size = posting->size ? 2 * posting->size : 4;
+			posting->items = erealloc(posting->items, posting->size * sizeof(*posting->items));
+		}
+		posting->items[posting->n++] = i;
 	}
 }
 
+/* drop the items indexed */
+static void
+clearindex(struct Index *index)
+{
+	size_t i;
+
+	for (i = 0; i < index->nslots; i++)
+		free(index->slots[i].items);
+	free(index->slots);
+	index->slots = NULL;
+	index->nslots = index->nkeys = index->nitems = 0;
+	for (i = 0; i < LEN(index->bounds); i++) {
+		free(index->bounds[i]);
+		index->bounds[i] = NULL;
+		index->nbounds[i] = 0;
+	}
+	free(index->carry);
+	free(index->merged);
+	index->carry = index->merged = NULL;
+	index->ncarry = 0;
+	index->coded = 0;
+}
+
+/* compare the bytes at a, of length alen, with the bytes at b, of length blen, as they are matched */
+static int
+cmpbytes(const char *a, size_t alen, const char *b, size_t blen)
+{
+	unsigned char x, y;
+	size_t i;
+
+	for (i = 0; i < alen && i < blen; i++) {
+		x = iflag ? tolower((unsigned char)a[i]) : (unsigned char)a[i];
+		y = iflag ? tolower((unsigned char)b[i]) : (unsigned char)b[i];
+		if (x != y)
+			return (x < y) ? -1 : 1;
+	}
+	return (alen < blen) ? -1 : (alen > blen);
+}
+
+/* compare two word boundaries by the bytes after them */
+static int
+cmpbound(const void *p, const void *q)
+{
+	const struct Boundary *a, *b;
+
+	a = p;
+	b = q;
+	return cmpbytes(a->s, a->len, b->s, b->len);
+}
+
+/* compare two item indices */
+static int
+cmpitem(const void *p, const void *q)
+{
+	uint32_t a, b;
+
+	a = *(const uint32_t *)p;
+	b = *(const uint32_t *)q;
+	return (a > b) - (a < b);
+}
+
+/*
+ * add to the boundaries at *bounds, of which there are *n and room for
+ * *size, the word boundaries of item i in its field s of length len:
+ * where strmatch() tries the input, at the beginning of the field and
+ * of each run of spaces after a word
+ */
+static void
+addbounds(struct Boundary **bounds, size_t *n, size_t *size, size_t i, const char *s, size_t len)
+{
+	size_t j;
+
+	for (j = 0; j < len; j++) {
+		if (j > 0 && !(isspace((unsigned char)s[j]) && !isspace((unsigned char)s[j - 1])))
+			continue;
+		if (*n == *size) {
+			*size = *size ? 2 * *size : 1024;
+			*bounds = erealloc(*bounds, *size * sizeof(**bounds));
+		}
+		(*bounds)[*n].s = s + j;
+		(*bounds)[*n].len = len - j;
+		(*bounds)[*n].item = i;
+		(*n)++;
+	}
+}
+
+/*
+ * merge at most MERGESIZ boundaries of the carry of the index into its
+ * runs; the carry is merged with the runs of the size it comes to, so
+ * there are as many runs as bits in the number of runs added, and each
+ * boundary is merged a logarithmic number of times.  The merging is
+ * done a step at a time, so a large merge does not hold up the input.
+ */
+static void
+mergebounds(struct Index *index)
+{
+	struct Boundary *a;
+	size_t na, k, m, left;
+
+	for (left = MERGESIZ; left > 0 && index->carry != NULL; ) {
+		k = index->mergek;
+		if (k == LEN(index->bounds))
+			errx(1, "too many items to index");
+		if (index->bounds[k] == NULL) {
+			index->bounds[k] = index->carry;
+			index->nbounds[k] = index->ncarry;
+			index->carry = NULL;
+			index->ncarry = 0;
+			break;
+		}
+		a = index->bounds[k];
+		na = index->nbounds[k];
+		if (index->merged == NULL) {
+			index->merged = emalloc((na + index->ncarry) * sizeof(*index->merged));
+			index->mergei = index->mergej = 0;
+		}
+		for (m = index->mergei + index->mergej; left > 0 && m < na + index->ncarry; m++, left--) {
+			if (index->mergej == index->ncarry ||
+			    (index->mergei < na && cmpbound(&a[index->mergei], &index->carry[index->mergej]) <= 0))
+				index->merged[m] = a[index->mergei++];
+			else
+				index->merged[m] = index->carry[index->mergej++];
+		}
+		if (m < na + index->ncarry)
+			break;
+
+		/* the merged run is carried into the next size */
+		free(a);
+		free(index->carry);
+		index->bounds[k] = NULL;
+		index->nbounds[k] = 0;
+		index->carry = index->merged;
+		index->ncarry = m;
+		index->merged = NULL;
+		index->mergek++;
+	}
+}
+
+/* add to the index the n sorted boundaries at bounds, once the ones added before are merged */
+static void
+pushbounds(struct Index *index, struct Boundary *bounds, size_t n)
+{
+	index->carry = bounds;
+	index->ncarry = n;
+	index->mergek = 0;
+	mergebounds(index);
+}
+
+/* get the number of items indexed; none if the items were removed since */
+static size_t
+nindexed(struct Prompt *prompt)
+{
+	return (prompt->index.gen == prompt->itemgen) ? prompt->index.nitems : 0;
+}
+
+/* index the next items not indexed yet, with -t; the index is built anew if items were removed */
+static void
+indexstep(struct Prompt *prompt)
+{
+	struct Index *index;
+	struct Table *table;
+	struct Boundary *bounds;
+	struct Run *run;
+	struct Item item;
+	const char *field;
+	size_t end, i, len, nbounds, boundsize;
+	enum Field f;
+
+	index = &prompt->index;
+	table = &prompt->items;
+	if (index->gen != prompt->itemgen) {
+		clearindex(index);
+		index->gen = prompt->itemgen;
+	}
+	if (index->carry != NULL) {
+		mergebounds(index);
+		return;
+	}
+	end = MIN(table->nitems, index->nitems + INDEXSIZ);
+	bounds = NULL;
+	nbounds = boundsize = 0;
+	for (i = index->nitems; i < end; i++) {
+		run = (i == index->nitems) ? itemrun(table, i) : seekrun(table, run, i);
+		item.text = runtext(table, run, run->base + table->off[i]);
+		item.textlen = table->len[i];
+		if (matchfields & ~(1 << FieldText))
+			splititem(&item);
+
+		/* the boundaries point into the text of the items, which front-coded items do not keep */
+		index->coded |= run->coded;
+		for (f = 0; f < FieldLast; f++) {
+			if (!(matchfields & (1 << f)) || (field = itemfield(&item, f, &len)) == NULL)
+				continue;
+			indextrigrams(index, i, field, len);
+			if (!index->coded)
+				addbounds(&bounds, &nbounds, &boundsize, i, field, len);
+		}
+	}
+	index->nitems = end;
+	if (index->coded || nbounds == 0) {
+		free(bounds);
+		return;
+	}
+	qsort(bounds, nbounds, sizeof(*bounds), cmpbound);
+	pushbounds(index, bounds, nbounds);
+}
+
+/* find the first of the n items at items that is not before item i */
+static size_t
+findindexed(const uint32_t *items, size_t n, size_t i)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (items[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * list in the index the items from beg up to end whose matched fields
+ * contain each trigram of text, of length len: only those can match it.
+ * Return 0 if the trigrams rule out too few of the items for looking
+ * them up to be faster than matching them all.
+ */
+static int
+lookupitems(struct Index *index, const char *text, size_t len, size_t beg, size_t end)
+{
+	struct Posting *postings[INPUTSIZ];
+	size_t from[INPUTSIZ], to[INPUTSIZ];
+	size_t n, least, i, j, k;
+	uint32_t item;
+
+	index->cands.n = 0;
+	if (index->nslots == 0)
+		return 0;
+	n = least = 0;
+	for (j = 0; j + 3 <= len; j++) {
+		postings[n] = findposting(index, trigramkey(text + j));
+		if (postings[n]->key == 0)
+			return 1;
+		from[n] = findindexed(postings[n]->items, postings[n]->n, beg);
+		to[n] = findindexed(postings[n]->items, postings[n]->n, end);
+		if (to[n] - from[n] < to[least] - from[least])
+			least = n;
+		n++;
+	}
+	if ((to[least] - from[least]) * SCANRATIO > end - beg)
+		return 0;
+
+	/* the items with the trigram fewest items have are looked up in the postings of the others */
+	for (i = from[least]; i < to[least]; i++) {
+		item = postings[least]->items[i];
+		for (k = 0; k < n; k++) {
+			if (k == least)
+				continue;
+			while (from[k] < to[k] && postings[k]->items[from[k]] < item)
+				from[k]++;
+			if (from[k] == to[k])
+				return 1;
+			if (postings[k]->items[from[k]] != item)
+				break;
+		}
+		if (k == n)
+			addmatch(&index->cands, item);
+	}
+	return 1;
+}
+
+/* add to the boundaries looked up in the index the items from beg up to end among the n sorted boundaries at bounds followed by text, of length len */
+static void
+lookuprun(struct Index *index, const struct Boundary *bounds, size_t n, const char *text, size_t len, size_t beg, size_t end)
+{
+	size_t lo, hi, mid, first, i;
+
+	/* the boundaries followed by text are next to each other, from the first one not before it */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmpbytes(bounds[mid].s, MIN(bounds[mid].len, len), text, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmpbytes(bounds[mid].s, MIN(bounds[mid].len, len), text, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = first; i < lo; i++)
+		if (bounds[i].item >= beg && bounds[i].item < end)
+			addmatch(&index->prefix, bounds[i].item);
+}
+
+/*
+ * list in the index, in order, the items from beg up to end whose
+ * matched fields have text, of length len, after a word boundary;
+ * return 0 if the boundaries are not kept
+ */
+static int
+lookupbounds(struct Index *index, const char *text, size_t len, size_t beg, size_t end)
+{
+	size_t k, i, n;
+
+	index->prefix.n = 0;
+	if (index->coded)
+		return 0;
+	for (k = 0; k < LEN(index->bounds); k++)
+		lookuprun(index, index->bounds[k], index->nbounds[k], text, len, beg, end);
+
+	/* the run being merged is still apart from the one it is merged into */
+	lookuprun(index, index->carry, index->ncarry, text, len, beg, end);
+
+	/* an item is listed once, however many of its boundaries are followed by text */
+	qsort(index->prefix.items, index->prefix.n, sizeof(*index->prefix.items), cmpitem);
+	for (i = n = 0; i < index->prefix.n; i++)
+		if (n == 0 || index->prefix.items[n - 1] != index->prefix.items[i])
+			index->prefix.items[n++] = index->prefix.items[i];
+	index->prefix.n = n;
+	return 1;
+}
+
+/* get how many items at most are left to match once text is looked up in the index, or SIZE_MAX if it cannot be */
+static size_t
+indexcost(struct Prompt *prompt, const char *text)
+{
+	struct Posting *posting;
+	size_t len, least, j;
+
+	len = strlen(text);
+	if (!tflag || zflag || len < 3 || prompt->index.nslots == 0 || nindexed(prompt) < prompt->scanned)
+		return SIZE_MAX;
+	least = SIZE_MAX;
+	for (j = 0; j + 3 <= len; j++) {
+		posting = findposting(&prompt->index, trigramkey(text + j));
+		least = MIN(least, posting->n);
+	}
+	return (least * SCANRATIO > nindexed(prompt)) ? SIZE_MAX : least;
+}
+
+/* match the items of table from beg up to, but not including, end against the input and list the matching ones */
+static void
+matchitems(struct Prompt *prompt, struct Table *table, size_t beg, size_t end)
+{
+	struct Matches *prefix, *middle, *bound, found, none;
+	const uint32_t *items;
+	const char *text;
+	size_t len, lim, first, n, i, j;
+
+	if (beg >= end)
+		return;
+	text = prompt->matchtext;
+
+	len = strlen(text);
+	prefix = &prompt->matches[matchclass(prompt, table, MATCHPREFIX)];
+	middle = &prompt->matches[matchclass(prompt, table, 0)];
+
+	/*
+	 * with -t, only the indexed items containing the trigrams of the
+	 * input are matched, the others cannot match it; this does not
+	 * hold for subsequences
+	 */
+	lim = (tflag && table == &prompt->items) ? MAX(beg, MIN(end, nindexed(prompt))) : beg;
+	items = NULL;
+	first = beg;
+	n = lim - beg;
+	if (n > 0 && !zflag && len >= 3 && lookupitems(&prompt->index, text, len, beg, lim)) {
+		memset(table->match + beg, FieldLast, lim - beg);
+		items = prompt->index.cands.items;
+		first = 0;
+		n = prompt->index.cands.n;
+	}
+
+	/*
+	 * items that match at a word boundary come before the items
+	 * that only match in the middle of a word.  With -t, the indexed
+	 * ones are looked up among the word boundaries, so the others
+	 * are only matched in the middle of words, which is faster; not
+	 * with -z, whose scores walk the items word by word
+	 */
+	if (n > 0 && len > 0 && !zflag && lookupbounds(&prompt->index, text, len, beg, lim)) {
+		bound = &prompt->index.prefix;
+		memset(&found, 0, sizeof(found));
+		memset(&none, 0, sizeof(none));
+		testitems(table, items, first, n, text, len, 1, &none, &found);
+		testitems(table, bound->items, 0, bound->n, text, len, 0, prefix, &none);
+		for (i = j = 0; i < found.n; i++) {
+			while (j < bound->n && bound->items[j] < found.items[i])
+				j++;
+			if (j == bound->n || bound->items[j] != found.items[i])
+				addmatch(middle, found.items[i]);
+		}
+		free(found.items);
+		free(none.items);
+	} else if (n > 0) {
+		testitems(table, items, first, n, text, len, 0, prefix, middle);
+	}
+	if (lim < end)
+		testitems(table, NULL, lim, end - lim, text, len, 0, prefix, middle);
+}
+
+/*
+ * match against the input only the items of table that matched the
+ * input it extends, listed in prefix and middle: an item matching the
+ * input matches what it extends, at a word boundary too if it matches
+ * the input at one, so the items in middle are only matched in the
+ * middle of words
+ */
+static void
+narrowitems(struct Prompt *prompt, struct Table *table, struct Matches *prefix, struct Matches *middle)
+{
+	struct Matches moved, none;
+	const char *text;
+	size_t len, i, j, k;
+
+	text = prompt->matchtext;
+	len = strlen(text);
+	memset(&none, 0, sizeof(none));
+	testitems(table, middle->items, 0, middle->n, text, len, 1, &none, middle);
+	free(none.items);
+
+	/* the items that no longer match at a word boundary go to the middle list, which is kept in order */
+	memset(&moved, 0, sizeof(moved));
+	testitems(table, prefix->items, 0, prefix->n, text, len, 0, prefix, &moved);
+	if (moved.n == 0)
+		return;
+	if (middle->n + moved.n > middle->size) {
+		middle->size = middle->n + moved.n;
+		middle->items = erealloc(middle->items, middle->size * sizeof(*middle->items));
+	}
+	i = middle->n;
+	j = moved.n;
+	for (k = middle->n + moved.n; j > 0; k--) {
+		if (i > 0 && middle->items[i - 1] > moved.items[j - 1])
+			middle->items[k - 1] = middle->items[--i];
+		else
+			middle->items[k - 1] = moved.items[--j];
+	}
+	middle->n += moved.n;
+	free(moved.items);
+}
+
+/* relist the matching items, matching against the input only the items that were not matched yet */
+static void
+rematchitems(struct Prompt *prompt)
+{
+	struct Table *tables[] = {&prompt->items, &prompt->fitems};
+	enum Class c;
+	size_t i, j, k;
+
+	for (c = 0; c < ClassLast; c++)
+		prompt->matches[c].n = 0;
+	for (j = 0; j < LEN(tables); j++) {
+		for (i = 0; i < tables[j]->nitems; i++) {
+			if (tables[j]->match[i] == MATCHNEW) {
+				/* the new items are next to each other, and are matched at once */
+				for (k = i + 1; k < tables[j]->nitems && tables[j]->match[k] == MATCHNEW; k++)
+					;
+				matchitems(prompt, tables[j], i, k);
+				i = k - 1;
+			} else if (tables[j]->match[i] != FieldLast) {
+				addmatch(&prompt->matches[matchclass(prompt, tables[j], tables[j]->match[i])], i);
+			}
+		}
+	}
+}
+
+/* compare two ranked items; the better one, or else the one listed first without -z, goes first */
+static int
+cmprank(const void *p, const void *q)
+{
+	const struct Rank *a, *b;
+
+	a = p;
+	b = q;
+	if (a->score != b->score)
+		return (a->score > b->score) ? -1 : 1;
+	if (a->class != b->class)
+		return (a->class < b->class) ? -1 : 1;
+	if (a->i != b->i)
+		return (a->i < b->i) ? -1 : 1;
+	return 0;
+}
+
+/* move the ranked item at position i of heap, of n items, down to its place; the worst item is at the top of the heap */
+static void
+siftrank(struct Rank *heap, size_t n, size_t i)
+{
+	struct Rank tmp;
+	size_t child;
+
+	for (; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && cmprank(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (cmprank(&heap[child], &heap[i]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+	}
+}
+
+/* add the ranked item rank to heap, of n items, which has room for it; the worst item is at the top of the heap */
+static void
+pushrank(struct Rank *heap, size_t n, struct Rank *rank)
+{
+	size_t parent;
+
+	for (; n > 0; n = parent) {
+		parent = (n - 1) / 2;
+		if (cmprank(&heap[parent], rank) >= 0)
+			break;
+		heap[n] = heap[parent];
+	}
+	heap[n] = *rank;
+}
+
+/* score item i of table, in run, by how well the field it matched matches text, of length len */
+static int
+scoreitem(struct Table *table, struct Run *run, size_t i, const char *text, size_t len)
+{
+	struct Item item;
+	const char *s;
+	size_t n;
+
+	if (len == 0)
+		return 0;
+	item.text = runtext(table, run, run->base + table->off[i]);
+	item.textlen = table->len[i];
+	item.description = item.output = NULL;
+	if ((table->match[i] & ~MATCHPREFIX) != FieldText)
+		splititem(&item);
+	s = itemfield(&item, table->match[i] & ~MATCHPREFIX, &n);
+	return fuzzyscore(s, n, text, len);
+}
+
+/*
+ * rank the items listed after the first n[class] ones of each class
+ * among the ranked items, or all the matching items anew if n is NULL.
+ * Only the best prompt->maxranks items are kept, in a heap while they
+ * are ranked, so the matching items are never sorted as a whole.
+ */
+static void
+rankmatches(struct Prompt *prompt, size_t n[])
+{
+	struct Table *table;
+	struct Rank rank, tmp;
+	struct Run *run;
+	const char *text;
+	enum Class c;
+	size_t len, i, j;
+
+	if (n == NULL)
+		prompt->nranks = 0;
+
+	/* the ranked items, best first, are a heap with the worst item at its top once reversed */
+	for (i = 0, j = prompt->nranks; i + 1 < j; i++, j--) {
+		tmp = prompt->ranks[i];
+		prompt->ranks[i] = prompt->ranks[j - 1];
+		prompt->ranks[j - 1] = tmp;
+	}
+	text = prompt->matchtext;
+	len = strlen(text);
+	for (c = 0; c < ClassLast; c++) {
+		table = classtable(prompt, c);
+		run = table->runs;
+		for (j = (n != NULL) ? n[c] : 0; j < prompt->matches[c].n; j++) {
+			rank.i = prompt->matches[c].items[j];
+			rank.class = c;
+			run = seekrun(table, run, rank.i);
+			rank.score = scoreitem(table, run, rank.i, text, len);
+			if (prompt->nranks < prompt->maxranks) {
+				pushrank(prompt->ranks, prompt->nranks++, &rank);
+			} else if (cmprank(&rank, &prompt->ranks[0]) < 0) {
+				prompt->ranks[0] = rank;
+				siftrank(prompt->ranks, prompt->nranks, 0);
+			}
+		}
+	}
+	qsort(prompt->ranks, prompt->nranks, sizeof(*prompt->ranks), cmprank);
+}
+
+/* get the position in the list of matching items of item i of the table of a class, NOITEM if it is not listed */
+static size_t
+matchpos(struct Prompt *prompt, enum Class class, size_t i)
+{
+	struct Matches *matches;
+	size_t pos, lo, hi, mid;
+	enum Class c;
+
+	if (zflag) {
+		for (pos = 0; pos < prompt->nranks; pos++)
+			if (prompt->ranks[pos].class == class && prompt->ranks[pos].i == i)
+				return pos;
+		return NOITEM;
+	}
+	pos = 0;
+	for (c = 0; c < class; c++)
+		pos += prompt->matches[c].n;
+	matches = &prompt->matches[class];
+	lo = 0;
+	hi = matches->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (matches->items[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < matches->n && matches->items[lo] == i) ? pos + lo : NOITEM;
+}
+
+/* move the positions in the list of matching items past the items appended to its classes, which had n[class] items */
+static void
+shiftmatches(struct Prompt *prompt, size_t n[])
+{
+	size_t *pos[] = {&prompt->selitem, &prompt->matchlist, &prompt->hoveritem};
+	size_t i, end, shift;
+	size_t id[LEN(pos)];
+	enum Class c, class[LEN(pos)];
+
+	/* ranked items are found again by index, as the items appended may rank before them; the list is not scrolled */
+	if (zflag) {
+		for (i = 0; i < LEN(pos); i++)
+			if (!matchitem(prompt, *pos[i], &class[i], &id[i]))
+				id[i] = NOITEM;
+		rankmatches(prompt, n);
+		for (i = 0; i < LEN(pos); i++)
+			if (pos[i] != &prompt->matchlist)
+				*pos[i] = (id[i] != NOITEM) ? matchpos(prompt, class[i], id[i]) : NOITEM;
+		if (prompt->selitem != NOITEM &&
+		    (prompt->selitem < prompt->matchlist || prompt->selitem >= prompt->matchlist + prompt->maxitems))
+			prompt->matchlist = prompt->selitem;
+		return;
+	}
+	for (i = 0; i < LEN(pos); i++) {
+		end = shift = 0;
+		for (c = 0; c < ClassLast && *pos[i] != NOITEM; c++) {
+			end += n[c];
+			if (*pos[i] < end) {
+				*pos[i] += shift;
+				break;
+			}
+			shift += prompt->matches[c].n - n[c];
+		}
+	}
+}
+
+/* free a memo */
+static void
+freememo(struct Memo *memo)
+{
+	free(memo->text);
+	free(memo->items);
+	free(memo->match);
+	free(memo);
+}
+
+/* take the memo of the input s out of the list of memos; return NULL if there is none */
+static struct Memo *
+takememo(struct Prompt *prompt, const char *s)
+{
+	struct Memo *memo, **p;
+
+	for (p = &prompt->memos; *p != NULL; p = &(*p)->next) {
+		if (strcmp((*p)->text, s) == 0) {
+			memo = *p;
+			*p = memo->next;
+			prompt->memosize -= memo->size;
+			return memo;
+		}
+	}
+	return NULL;
+}
+
+/* keep the lists of the items matching the input they were matched against, within the budget for them; text is the new input */
+static void
+savememo(struct Prompt *prompt, const char *text)
+{
+	struct Matches *prefix, *middle;
+	struct Memo *memo, **p, **last, **victim;
+	size_t size, i;
+
+	prefix = &prompt->matches[ClassPrefix];
+	middle = &prompt->matches[ClassMiddle];
+	if ((memo = takememo(prompt, prompt->matchtext)) != NULL)
+		freememo(memo);
+	size = sizeof(*memo) + strlen(prompt->matchtext) + 1 +
+	       (prefix->n + middle->n) * (sizeof(*memo->items) + sizeof(*memo->match));
+	if (size > config.matchcache)
+		return;
+
+	/*
+	 * the least recently used memos go first, but the memos of what
+	 * the input extends go last, as they are the way back when the
+	 * input is erased
+	 */
+	while (prompt->memosize + size > config.matchcache) {
+		last = victim = NULL;
+		for (p = &prompt->memos; *p != NULL; p = &(*p)->next) {
+			last = p;
+			if (strncmp(text, (*p)->text, strlen((*p)->text)) != 0)
+				victim = p;
+		}
+		if (victim == NULL)
+			victim = last;
+		memo = *victim;
+		*victim = memo->next;
+		prompt->memosize -= memo->size;
+		freememo(memo);
+	}
+
+	memo = emalloc(sizeof(*memo));
+	memo->text = estrdup(prompt->matchtext);
+	memo->nprefix = prefix->n;
+	memo->nmiddle = middle->n;
+	memo->items = emalloc((prefix->n + middle->n) * sizeof(*memo->items));
+	memo->match = emalloc(prefix->n + middle->n);
+	memcpy(memo->items, prefix->items, prefix->n * sizeof(*memo->items));
+	memcpy(memo->items + prefix->n, middle->items, middle->n * sizeof(*memo->items));
+	for (i = 0; i < prefix->n + middle->n; i++)
+		memo->match[i] = prompt->items.match[memo->items[i]];
+	memo->nitems = prompt->scanned;
+	memo->gen = prompt->itemgen;
+	/* file completions are listed anew, so only the positions on items are kept */
+	if (!matchitem(prompt, prompt->selitem, &memo->selclass, &memo->selid) ||
+	    classtable(prompt, memo->selclass) != &prompt->items)
+		memo->selid = NOITEM;
+	if (!matchitem(prompt, prompt->matchlist, &memo->listclass, &memo->listid) ||
+	    classtable(prompt, memo->listclass) != &prompt->items)
+		memo->listid = NOITEM;
+	memo->size = size;
+	memo->next = prompt->memos;
+	prompt->memos = memo;
+	prompt->memosize += size;
+}
+
+/* set the items of a list of matching items */
+static void
+setmatches(struct Matches *matches, const uint32_t *items, size_t n)
+{
+	if (n > matches->size) {
+		matches->size = n;
+		matches->items = erealloc(matches->items, n * sizeof(*matches->items));
+	}
+	memcpy(matches->items, items, n * sizeof(*items));
+	matches->n = n;
+}
+
+/*
+ * list the items matching the input from its memo, if the items were
+ * only added to since it was kept; the items added are left to be
+ * matched.  Return the memo, put back first in the list of memos, or NULL.
+ */
+static struct Memo *
+recallmemo(struct Prompt *prompt)
+{
+	struct Memo *memo;
+	size_t i;
+
+	if ((memo = takememo(prompt, prompt->matchtext)) == NULL)
+		return NULL;
+	memo->next = prompt->memos;
+	prompt->memos = memo;
+	prompt->memosize += memo->size;
+	if (memo->gen != prompt->itemgen || memo->nitems > prompt->items.nitems)
+		return NULL;
+	memset(prompt->items.match, FieldLast, memo->nitems);
+	for (i = 0; i < memo->nprefix + memo->nmiddle; i++)
+		prompt->items.match[memo->items[i]] = memo->match[i];
+	setmatches(&prompt->matches[ClassPrefix], memo->items, memo->nprefix);
+	setmatches(&prompt->matches[ClassMiddle], memo->items + memo->nprefix, memo->nmiddle);
+	prompt->scanned = memo->nitems;
+	return memo;
+}
+
+/* match against the input the next items not matched yet; with -l, only as many as there are threads to match them */
+static void
+scanstep(struct Prompt *prompt)
+{
+	size_t end;
+
+	end = lflag ? MIN(prompt->items.nitems, prompt->scanned + MATCHSIZ * nthreads) : prompt->items.nitems;
+	matchitems(prompt, &prompt->items, prompt->scanned, end);
+	if (!jobcancelled())
+		prompt->scanned = end;
+}
+
+/*
+ * match against the input the items not matched yet, until need items
+ * are listed as matching at a word boundary.  Those come first in the
+ * list, and the items after them are matched in order, so the first
+ * need positions of the list do not change as the others are matched.
+ */
+static void
+scanitems(struct Prompt *prompt, size_t need)
+{
+	while (prompt->scanned < prompt->items.nitems && prompt->matches[ClassPrefix].n < need && !jobcancelled())
+		scanstep(prompt);
+}
+
+/* return how many items matching at a word boundary list the page after the selected item; all of them but with -l */
+static size_t
+listneed(struct Prompt *prompt)
+{
+	if (!lflag || zflag)
+		return SIZE_MAX;
+	return MAX(prompt->matchlist, prompt->selitem + 1) + 2 * prompt->maxitems;
+}
+
+/* create list of the items matching text; it is left stale if the matching is cancelled */
+static void
+getmatchlist(struct Prompt *prompt, const char *text)
+{
+	struct Memo *memo;
+	size_t pos;
+	int narrow;
+
+	/* the lists for the input left are kept, and the ones for the new input are taken back if they were kept */
+	if (config.matchcache > 0 && !prompt->stale)
+		savememo(prompt, text);
+	narrow = !prompt->stale && strncmp(text, prompt->matchtext, strlen(prompt->matchtext)) == 0;
+	/* with -t, looking the input up may leave fewer items to match than the ones listed */
+	if (narrow && indexcost(prompt, text) < prompt->matches[ClassPrefix].n + prompt->matches[ClassMiddle].n)
+		narrow = 0;
+	strcpy(prompt->matchtext, text);
+	prompt->stale = 1;
+	if ((memo = recallmemo(prompt)) != NULL) {
+		/* only the items added since are matched, below */
+	} else if (narrow) {
+		/* when the input is extended, the items that did not match it before cannot match it now */
+		narrowitems(prompt, &prompt->items, &prompt->matches[ClassPrefix], &prompt->matches[ClassMiddle]);
+	} else {
+		prompt->matches[ClassPrefix].n = prompt->matches[ClassMiddle].n = 0;
+		prompt->scanned = 0;
+	}
+
+	/*
+	 * with -l, the items are matched as far as the first screen; the
+	 * others are matched as the list is scrolled, or when there is
+	 * nothing else to do.  All of them are ranked with -z, and a
+	 * position kept past the items matching at a word boundary
+	 * moves as more of them are found
+	 */
+	if (!lflag || zflag || (memo != NULL &&
+	    ((memo->listid != NOITEM && memo->listclass != ClassPrefix) ||
+	     (memo->selid != NOITEM && memo->selclass != ClassPrefix))))
+		scanitems(prompt, SIZE_MAX);
+	else
+		scanitems(prompt, prompt->maxitems);
+
+	/* the file completions are listed anew for each input */
+	prompt->matches[ClassFilePrefix].n = prompt->matches[ClassFileMiddle].n = 0;
+	matchitems(prompt, &prompt->fitems, 0, prompt->fitems.nitems);
+	if (jobcancelled())
+		return;
+	prompt->stale = 0;
+	if (zflag)
+		rankmatches(prompt, NULL);
+	prompt->matchlist = 0;
+	prompt->selitem = NOITEM;
+
+	/* the list is scrolled back to where it was when the input was left */
+	if (memo != NULL && memo->listid != NOITEM && (pos = matchpos(prompt, memo->listclass, memo->listid)) != NOITEM)
+		prompt->matchlist = pos;
+	if (memo != NULL && memo->selid != NOITEM)
+		prompt->selitem = matchpos(prompt, memo->selclass, memo->selid);
+}
+
+/* navigate through the list of matching items; and set the number of listed items */
+static void
+navmatchlist(struct Prompt *prompt, int direction)
+{
+	size_t n;
+
+	/* with -l, the items are matched as far as the page after the selected item */
+	scanitems(prompt, listneed(prompt));
+	n = nmatches(prompt);
+	if (direction != 0 && prompt->selitem == NOITEM) {
+		if (n > 0)
+			prompt->selitem = prompt->matchlist;
+		goto done;
+	}
+	if (prompt->selitem == NOITEM)
+		goto done;
+	if (direction > 0 && prompt->selitem + 1 < n) {
+		prompt->selitem++;
+		if (prompt->selitem >= prompt->matchlist + prompt->maxitems)
+			prompt->matchlist = prompt->selitem;
+	} else if (direction < 0 && prompt->selitem > 0) {
+		prompt->selitem--;
+		if (prompt->selitem < prompt->matchlist)
+			prompt->matchlist = (prompt->matchlist > prompt->maxitems) ? prompt->matchlist - prompt->maxitems : 0;
+	}
+
+done:
+	/* with -z, the items are ranked as far as they are listed */
+	if (zflag && prompt->nranks == prompt->maxranks && prompt->nranks < n &&
+	    prompt->matchlist + prompt->maxitems > prompt->nranks) {
+		prompt->maxranks = MAX(2 * prompt->maxranks, prompt->matchlist + prompt->maxitems);
+		prompt->ranks = erealloc(prompt->ranks, prompt->maxranks * sizeof(*prompt->ranks));
+		rankmatches(prompt, NULL);
+	}
+	prompt->nitems = (prompt->matchlist < n) ? MIN(prompt->maxitems, n - prompt->matchlist) : 0;
+}
+
+/* list the items matching the inputs posted by the event loop, until the thread is stopped */
+static void *
+listthread(void *arg)
+{
+	struct Prompt *prompt;
+	char *text;
+	size_t gen;
+
+	prompt = (struct Prompt *)arg;
+	text = emalloc(INPUTSIZ);
+	pthread_mutex_lock(&joblock);
+	for (;;) {
+		while (prompt->listgen == prompt->postgen && !job.quit)
+			pthread_cond_wait(&inputposted, &joblock);
+		if (job.quit)
+			break;
+		gen = prompt->postgen;
+		strcpy(text, prompt->posttext);
+		job.cancel = 0;
+		pthread_mutex_unlock(&joblock);
+		getmatchlist(prompt, text);
+		pthread_mutex_lock(&joblock);
+
+		/* a cancelled input is done too, but only the input posted last is reported */
+		prompt->listgen = gen;
+		if (gen == prompt->postgen) {
+			pthread_cond_signal(&inputdone);
+			(void)write(listpipe[1], "", 1);
+		}
+	}
+	pthread_mutex_unlock(&joblock);
+	free(text);
+	return NULL;
+}
+
+/* start the thread listing the items matching the input */
+static void
+startlister(struct Prompt *prompt)
+{
+	int flags, i;
+
+	if (pipe(listpipe) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl(listpipe[i], F_GETFL)) == -1 ||
+		    fcntl(listpipe[i], F_SETFL, flags | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	if ((errno = pthread_create(&lister, NULL, listthread, prompt)) != 0)
+		err(1, "pthread_create");
+}
+
+/*
+ * hand the input to the lister thread, which drops the input it is
+ * matching the items against, if any.  The input is copied under
+ * joblock, which is never held while the items are matched, so this
+ * does not wait on matching; the lister thread sleeps on a condition
+ * of joblock until an input is posted, and the results come back
+ * through listpipe without the lock.
+ */
+static void
+postinput(struct Prompt *prompt)
+{
+	pthread_mutex_lock(&joblock);
+	strcpy(prompt->posttext, prompt->text);
+	prompt->postgen++;
+	job.cancel = prompt->matching;
+	prompt->matching = 1;
+	pthread_cond_signal(&inputposted);
+	pthread_mutex_unlock(&joblock);
+}
+
+/* take the items back from the lister thread if it is done with the input posted last, waiting for it if wait is set; return whether they were */
+static int
+takematches(struct Prompt *prompt, int wait)
+{
+	int done;
+
+	pthread_mutex_lock(&joblock);
+	while (wait && prompt->listgen != prompt->postgen)
+		pthread_cond_wait(&inputdone, &joblock);
+	done = prompt->listgen == prompt->postgen;
+	pthread_mutex_unlock(&joblock);
+	if (!done)
+		return 0;
+	prompt->matching = 0;
+	navmatchlist(prompt, 0);
+	return 1;
+}
+
+/* wait for the lister thread to be done, before the items or their lists are used */
+static void
+waitmatches(struct Prompt *prompt)
+{
+	if (prompt->matching)
+		takematches(prompt, 1);
+}
+
+/* take the items back from the lister thread once it is done, and draw them */
+static void
+readmatches(struct Prompt *prompt)
+{
+	char buf[64];
+
+	while (read(listpipe[0], buf, sizeof(buf)) > 0)
+		;
+	if (prompt->matching && takematches(prompt, 0))
+		drawprompt(prompt);
+}
+
+/* get Ctrl input operation */
+static enum Ctrl
+getoperation(KeySym ksym, unsigned state)
+{
+	switch (ksym) {
+	case XK_Escape:         return CTRLCANCEL;
+	case XK_Return:         return CTRLENTER;
+	case XK_KP_Enter:       return CTRLENTER;
+	case XK_ISO_Left_Tab:   return CTRLPREV;
+	case XK_Tab:            return CTRLNEXT;
+	case XK_Prior:          return CTRLPGUP;
+	case XK_Next:           return CTRLPGDOWN;
+	case XK_BackSpace:      return CTRLDELLEFT;
+	case XK_Delete:         return CTRLDELRIGHT;
+	case XK_Up:             return CTRLUP;
+	case XK_Down:           return CTRLDOWN;
+	case XK_Home:
+		if (state & ShiftMask)
+			return CTRLSELBOL;
+		return CTRLBOL;
+	case XK_End:
+		if (state & ShiftMask)
+			return CTRLSELEOL;
+		return CTRLEOL;
+	case XK_Left:
+		if (state & ShiftMask && state & ControlMask)
+			return CTRLSELWLEFT;
+		if (state & ShiftMask)
+			return CTRLSELLEFT;
+		if (state & ControlMask)
+			return CTRLWLEFT;
+		return CTRLLEFT;
+	case XK_Right:
+		if (state & ShiftMask && state & ControlMask)
+			return CTRLSELWRIGHT;
+		if (state & ShiftMask)
+			return CTRLSELRIGHT;
+		if (state & ControlMask)
+			return CTRLWRIGHT;
+		return CTRLRIGHT;
+	}
+
+	/* handle Ctrl + Letter combinations */
+	if (state & ControlMask && ((ksym >= XK_a && ksym <= XK_z) || (ksym >= XK_A && ksym <= XK_Z))) {
+		if (state & ShiftMask) {
+			switch (ksym) {
+			case XK_A: case XK_a:   return CTRLSELBOL;
+			case XK_E: case XK_e:   return CTRLSELEOL;
+			case XK_B: case XK_b:   return CTRLSELLEFT;
+			case XK_F: case XK_f:   return CTRLSELRIGHT;
+			case XK_Z: case XK_z:   return CTRLREDO;
+			}
+		} else {
+			switch (ksym) {
+			case XK_a:              return CTRLBOL;
+			case XK_b:              return CTRLLEFT;
+			case XK_c:              return CTRLCOPY;
+			case XK_d:              return CTRLDELRIGHT;
+			case XK_e:              return CTRLEOL;
+			case XK_f:              return CTRLRIGHT;
+			case XK_h:              return CTRLDELLEFT;
+			case XK_k:              return CTRLDELEOL;
+			case XK_m:              return CTRLENTER;
+			case XK_n:              return CTRLNEXT;
+			case XK_p:              return CTRLPREV;
+			case XK_u:              return CTRLDELBOL;
+			case XK_v:              return CTRLPASTE;
+			case XK_w:              return CTRLDELWORD;
+			case XK_z:              return CTRLUNDO;
+			}
+		}
+		return CTRLNOTHING;
+	}
+
+	return INSERT;
+}
+
+/* copy entry from undo list into text */
+static void
+undo(struct Prompt *prompt)
+{
+	if (prompt->undocurr) {
+		if (prompt->undocurr->text == NULL) {
+			return;
+		}
+		if (strcmp(prompt->undocurr->text, prompt->text) == 0)
+			prompt->undocurr = prompt->undocurr->next;
+	}
+	if (prompt->undocurr) {
+		insert(prompt, NULL, 0 - prompt->cursor);
+		insert(prompt, prompt->undocurr->text, strlen(prompt->undocurr->text));
+		prompt->undocurr = prompt->undocurr->next;
+	}
+}
+
+/* copy entry from undo list into text */
+static void
+redo(struct Prompt *prompt)
+{
+	if (prompt->undocurr && prompt->undocurr->prev)
+		prompt->undocurr = prompt->undocurr->prev;
+	if (prompt->undocurr && prompt->undocurr->prev && strcmp(prompt->undocurr->text, prompt->text) == 0)
+		prompt->undocurr = prompt->undocurr->prev;
+	if (prompt->undocurr) {
+		insert(prompt, NULL, 0 - prompt->cursor);
+		insert(prompt, prompt->undocurr->text, strlen(prompt->undocurr->text));
+	}
+}
+
+/* print typed string */
+static void
+print(struct Prompt *prompt)
+{
+	struct Item item;
+
+	if (prompt->selitem != NOITEM) {
+		getmatch(prompt, prompt->selitem, &item);
+		if (item.group != 0) {
+			printf("%s\t", item.groupname);
+		}
+		if (item.output != NULL) {
+			fwrite(item.output, 1, item.outlen, stdout);
+		} else {
+			fwrite(item.text, 1, item.textlen, stdout);
+		}
+		putchar('\n');
+	} else {
+		printf("%s\n", prompt->text);
+	}
+}
+
+/* run the command again once the input is left alone for a while; ask the running one to stop right away, it is killed when the command is run again */
+static void
+reruncommand(struct Prompt *prompt)
+{
+	struct Source *src;
+
+	for (src = prompt->sources; src; src = src->next)
+		if (src->pid > 0)
+			kill(-src->pid, SIGTERM);
+	clock_gettime(CLOCK_MONOTONIC, &prompt->rerun);
+	prompt->rerun.tv_nsec += RERUNDELAY * 1000000L;
+	prompt->rerun.tv_sec += prompt->rerun.tv_nsec / 1000000000L;
+	prompt->rerun.tv_nsec %= 1000000000L;
+	prompt->pending = 1;
+}
+
 /* handle key press */
 static enum Press_ret
-keypress(struct Prompt *prompt, XKeyEvent *ev)
+keypress(struct Prompt *prompt, XKeyEvent *ev)
+{
+	static char buf[INPUTSIZ];
+	static enum Ctrl prevoperation = CTRLNOTHING;
+	enum Ctrl operation;
+	char *s;
+	int len;
+	int dir;
+	KeySym ksym;
+	Status status;
+
+	len = XmbLookupString(ic.xic, ev, buf, sizeof buf, &ksym, &status);
+	switch (status) {
+	default: /* XLookupNone, XBufferOverflow */
+		return Nop;
+	case XLookupChars:
+		goto insert;
+	case XLookupKeySym:
+	case XLookupBoth:
+		break;
+	}
+
+	operation = getoperation(ksym, ev->state);
+	if (operation == INSERT && (iscntrl(*buf) || *buf == '\0'))
+		return Nop;
+	if (ISUNDO(operation) && ISEDITING(prevoperation))
+		addundo(prompt, 0);
+	if (ISEDITING(operation) && operation != prevoperation)
+		addundo(prompt, 1);
+	prevoperation = operation;
+	switch (operation) {
+	case CTRLPASTE:
+		XConvertSelection(dpy, atoms[Clipboard], atoms[Utf8String], atoms[Utf8String], prompt->win, CurrentTime);
+		return Nop;
+	case CTRLCOPY:
+		XSetSelectionOwner(dpy, atoms[Clipboard], prompt->win, CurrentTime);
+		return Nop;
+	case CTRLCANCEL:
+		return Esc;
+	case CTRLENTER:
+		waitmatches(prompt);
+		print(prompt);
+		return Enter;
+	case CTRLPREV:
+		/* FALLTHROUGH */
+	case CTRLNEXT:
+		waitmatches(prompt);
+		if (nmatches(prompt) == 0) {
+			getmatchlist(prompt, prompt->text);
+			navmatchlist(prompt, 0);
+		} else if (operation == CTRLNEXT) {
+			navmatchlist(prompt, 1);
+		} else if (operation == CTRLPREV) {
+			navmatchlist(prompt, -1);
+		}
+		break;
+	case CTRLPGUP:
+	case CTRLPGDOWN:
+		/* TODO */
+		return Nop;
+	case CTRLSELBOL:
+	case CTRLBOL:
+		prompt->cursor = 0;
+		break;
+	case CTRLSELEOL:
+	case CTRLEOL:
+		if (prompt->text[prompt->cursor] != '\0')
+			prompt->cursor = strlen(prompt->text);
+		break;
+	case CTRLUP:
+		/* FALLTHROUGH */
+	case CTRLDOWN:
+		dir = (operation == CTRLUP) ? -1 : +1;
+		if (prompt->histsize == 0)
+			return Nop;
+		s = navhist(prompt, dir);
+		if (s) {
+			insert(prompt, NULL, 0 - prompt->cursor);
+			insert(prompt, s, strlen(s));
+		}
+		break;
+	case CTRLSELLEFT:
+	case CTRLLEFT:
+		if (prompt->cursor > 0)
+			prompt->cursor = nextrune(prompt->text, prompt->cursor, -1);
+		else
+			return Nop;
+		break;
+	case CTRLSELRIGHT:
+	case CTRLRIGHT:
+		if (prompt->text[prompt->cursor] != '\0')
+			prompt->cursor = nextrune(prompt->text, prompt->cursor, +1);
+		else
+			return Nop;
+		break;
+	case CTRLSELWLEFT:
+	case CTRLWLEFT:
+		prompt->cursor = movewordedge(prompt->text, prompt->cursor, -1);
+		break;
+	case CTRLSELWRIGHT:
+	case CTRLWRIGHT:
+		prompt->cursor = movewordedge(prompt->text, prompt->cursor, +1);
+		break;
+	case CTRLDELBOL:
+		insert(prompt, NULL, 0 - prompt->cursor);
+		break;
+	case CTRLDELEOL:
+		prompt->text[prompt->cursor] = '\0';
+		break;
+	case CTRLDELRIGHT:
+	case CTRLDELLEFT:
+		if (prompt->cursor != prompt->select) {
+			delselection(prompt);
+			break;
+		}
+		if (operation == CTRLDELRIGHT) {
+			if (prompt->text[prompt->cursor] == '\0')
+				return Nop;
+			prompt->cursor = nextrune(prompt->text, prompt->cursor, +1);
+		}
+		if (prompt->cursor == 0)
+			return Nop;
+		insert(prompt, NULL, nextrune(prompt->text, prompt->cursor, -1) - prompt->cursor);
+		break;
+	case CTRLDELWORD:
+		delword(prompt);
+		break;
+	case CTRLUNDO:
+		undo(prompt);
+		break;
+	case CTRLREDO:
+		redo(prompt);
+		break;
+	case CTRLNOTHING:
+		return Nop;
+	case INSERT:
+insert:
+		operation = INSERT;
+		if (iscntrl(*buf) || *buf == '\0')
+			return Nop;
+		if (*buf == '/' && fflag) {
+			waitmatches(prompt);
+			resetarena(&prompt->files);
+			getfilelist(prompt);
+		}
+		delselection(prompt);
+		insert(prompt, buf, len);
+		break;
+	}
+
+	if (ISMOTION(operation)) {          /* moving cursor while selecting */
+		prompt->select = prompt->cursor;
+		return DrawPrompt;
+	}
+	if (ISSELECTION(operation)) {       /* moving cursor while selecting */
+		XSetSelectionOwner(dpy, XA_PRIMARY, prompt->win, CurrentTime);
+		return DrawInput;
+	}
+	if (ISEDITING(operation) || ISUNDO(operation)) {
+		if (fflag && operation != INSERT) {
+			waitmatches(prompt);
+			resetarena(&prompt->files);
+			getfilelist(prompt);
+		}
+		postinput(prompt);
+		if (ecmd != NULL)
+			reruncommand(prompt);
+		return DrawPrompt;
+	}
+	return DrawPrompt;
+}
+
+/* get the position, in characters, of the cursor given a x position */
+static size_t
+getcurpos(struct Prompt *prompt, int x)
+{
+	const char *s = prompt->text;
+	int w;
+	size_t len = 0;
+	const char *next;
+	int textwidth;
+
+	w = dc.pad;
+	while (*s) {
+		if (x < w)
+			break;
+		(void)getnextutf8char(s, &next);
+		len = strlen(prompt->text) - strlen(++s);
+		textwidth = drawtext(NULL, NULL, 0, 0, 0, prompt->text, len);
+		w = dc.pad + textwidth;
+		s = next;
+	}
+
+	/* the loop returns len 1 char to the right */
+	if (len && x + 3 < w)   /* 3 pixel tolerance */
+		len--;
+
+	return len;
+}
+
+/* get the position of the item on a given y position, NOITEM if none */
+static size_t
+getitem(struct Prompt *prompt, int y)
+{
+	size_t n;
+
+	y -= prompt->h + prompt->separator;
+	y = MAX(y, 0);
+	n = y / prompt->h;
+	if (n > prompt->nitems || prompt->nitems == 0)
+		return NOITEM;
+	return prompt->matchlist + MIN(n, prompt->nitems - 1);
+}
+
+/* handle button press */
+static enum Press_ret
+buttonpress(struct Prompt *prompt, XButtonEvent *ev)
+{
+	static int word = 0;    /* whether a word was selected by double click */
+	static Time lasttime = 0;
+	size_t curpos;
+
+	if (ic.composing)       /* we ignore mouse events when composing */
+		return Nop;
+	switch (ev->button) {
+	case Button2:                               /* middle click paste */
+		delselection(prompt);
+		XConvertSelection(dpy, XA_PRIMARY, atoms[Utf8String], atoms[Utf8String], prompt->win, CurrentTime);
+		return Nop;
+	case Button1:
+		if (ev->y < 0 || ev->x < 0)
+			return Nop;
+		if (ev->y <= prompt->h) {
+			curpos = getcurpos(prompt, ev->x);
+			if (word && ev->time - lasttime < DOUBLECLICK) {
+				prompt->cursor = 0;
+				if (prompt->text[prompt->cursor] != '\0')
+					prompt->select = strlen(prompt->text);
+				word = 0;
+			} else if (ev->time - lasttime < DOUBLECLICK) {
+				prompt->cursor = movewordedge(prompt->text, curpos, -1);
+				prompt->select = movewordedge(prompt->text, curpos, +1);
+				word = 1;
+			} else {
+				prompt->select = prompt->cursor = curpos;
+				word = 0;
+			}
+			lasttime = ev->time;
+			return DrawInput;
+		} else if (ev->y > prompt->h + prompt->separator) {
+			waitmatches(prompt);
+			if ((prompt->selitem = getitem(prompt, ev->y)) == NOITEM)
+				return Nop;
+			print(prompt);
+			return Enter;
+		}
+		return Nop;
+	default:
+		return Nop;
+	}
+
+	return Nop;
+}
+
+/* handle button motion X event */
+static enum Press_ret
+buttonmotion(struct Prompt *prompt, XMotionEvent *ev)
+{
+	size_t prevselect, prevcursor;
+
+	prevselect = prompt->select;
+	prevcursor = prompt->cursor;
+
+	if (ic.composing)       /* we ignore mouse events when composing */
+		return Nop;
+	if (ev->y >= 0 && ev->y <= prompt->h)
+		prompt->select = getcurpos(prompt, ev->x);
+	else if (ev->y < 0)
+		prompt->select = 0;
+	else if (prompt->text[prompt->cursor] != '\0')
+		prompt->cursor = strlen(prompt->text);
+	else
+		return Nop;
+
+	/* if the selection didn't change there's no need to redraw input */
+	if (prompt->select == prevselect && prompt->cursor == prevcursor)
+		return Nop;
+
+	return DrawInput;
+}
+
+/* handle pointer motion X event */
+static enum Press_ret
+pointermotion(struct Prompt *prompt, XMotionEvent *ev)
+{
+	static int intext = 0;
+	size_t prevhover;
+	int miny, maxy;
+
+	if (ev->y < prompt->h && !intext) {
+		XDefineCursor(dpy, prompt->win, cursor);
+		intext = 1;
+	} else if (ev->y >= prompt->h && intext) {
+		XUndefineCursor(dpy, prompt->win);
+		intext = 0;
+	}
+	if (ic.composing)       /* we ignore mouse events when composing */
+		return Nop;
+	if (prompt->matching)   /* and the items until they are matched */
+		return Nop;
+	miny = prompt->h + prompt->separator;
+	maxy = miny + prompt->h * prompt->nitems;
+	prevhover = prompt->hoveritem;
+	if (ev->y < miny || ev->y >= maxy)
+		prompt->hoveritem = NOITEM;
+	else
+		prompt->hoveritem = getitem(prompt, ev->y);
+
+	return (prevhover != prompt->hoveritem) ? DrawPrompt : Nop;
+}
+
+/* resize prompt */
+static enum Press_ret
+resize(struct Prompt *prompt, XConfigureEvent *ev)
+{
+	prompt->w = ev->width;
+	destroypix(prompt);
+	createpix(prompt);
+	return DrawPrompt;
+}
+
+/* save history in history file */
+static void
+savehist(struct Prompt *prompt)
+{
+	int diff;   /* whether the last history entry differs from prompt->text */
+	int fd;
+
+	if (prompt->histfp == NULL)
+		return;
+
+	fd = fileno(prompt->histfp);
+	ftruncate(fd, 0);
+
+	if (!prompt->histsize) {
+		fprintf(prompt->histfp, "%s\n", prompt->text);
+		return;
+	}
+
+	diff = strcmp(prompt->history[prompt->histsize - 1], prompt->text);
+
+	prompt->histindex = (diff && prompt->histsize == config.histsize) ? 1 : 0;
+
+	while (prompt->histindex < prompt->histsize)
+		fprintf(prompt->histfp, "%s\n", prompt->history[prompt->histindex++]);
+
+	if (diff)
+		fprintf(prompt->histfp, "%s\n", prompt->text);
+}
+
+/* create completion item from a line of len bytes read from stdin */
+static void
+parseline(struct Parse *parse, const char *line, size_t len)
+{
+	const char *s;
+	size_t textlen;
+
+	/* discard empty lines */
+	if (len == 0) {
+		parse->setgroup = 1;
+		return;
+	}
+
+	if (gflag && parse->setgroup) {
+		parse->group = interngroup(&parse->table, &parse->arena, line, len);
+		parse->setgroup = 0;
+		return;
+	}
+
+	/* get the item text; the description and the output are found after it when needed */
+	textlen = ((s = memchr(line, '\t', len)) != NULL) ? (size_t)(s - line) : len;
+
+	/* discard empty text entries */
+	if (textlen == 0)
+		return;
+
+	/* the item is in the last group named before it, if any; with -P, the whole line is coded, for the fields after the text */
+	if (Pflag && !parse->source->watch) {
+		s = encodeline(&parse->coder, &parse->arena, line, len);
+		additem(&parse->table, parse->coder.block, s, textlen, parse->group);
+	} else {
+		additem(&parse->table, NULL, line, textlen, parse->group);
+	}
+}
+
+/* create completion items from the lines from parse->beg on that end before parse->end, searching for newlines from s on */
+static void
+parsebuf(struct Parse *parse, const char *s)
+{
+	const char *line;
+
+	line = parse->beg;
+	while ((s = memchr(s, '\n', parse->end - s)) != NULL) {
+		parseline(parse, line, s - line);
+		line = ++s;
+	}
+	parse->beg = line;
+}
+
+/* parse a chunk of the input on a worker thread */
+static void *
+parsethread(void *arg)
+{
+	struct Parse *parse;
+
+	parse = (struct Parse *)arg;
+	parsebuf(parse, parse->beg);
+	return NULL;
+}
+
+/* prepare to parse the input from beg to end */
+static void
+initparse(struct Parse *parse, struct Source *src, const char *beg, const char *end, int setgroup)
+{
+	parse->next = NULL;
+	parse->source = src;
+	parse->beg = beg;
+	parse->end = end;
+	memset(&parse->table, 0, sizeof(parse->table));
+	parse->group = 0;
+	memset(&parse->arena, 0, sizeof(parse->arena));
+	memset(&parse->coder, 0, sizeof(parse->coder));
+	parse->setgroup = setgroup;
+	parse->reload = 0;
+	parse->buf = parse->oldbuf = NULL;
+	parse->len = parse->oldlen = 0;
+	parse->prefix = parse->suffix = 0;
+}
+
+/* get the string printed when the item whose text is s, of length len, is selected, without the group */
+static const char *
+itemkey(const char *s, size_t len, size_t *keylen)
+{
+	struct Item item;
+
+	item.text = s;
+	item.textlen = len;
+	splititem(&item);
+	if (item.output != NULL) {
+		*keylen = item.outlen;
+		return item.output;
+	}
+	*keylen = len;
+	return s;
+}
+
+/* hash the string printed when item i of table is selected */
+static size_t
+hashitem(struct Table *table, size_t i)
+{
+	const char *key;
+	size_t len;
+
+	key = itemkey(itemtext(table, i), table->len[i], &len);
+	return hashkey(key, len, itemgroup(table, i));
+}
+
+/*
+ * insert the item with text s, of length len, into the set of unique
+ * items as the next item of the prompt; return 0 if an item printing
+ * the same string is already in it
+ */
+static int
+uniqitem(struct Prompt *prompt, const char *s, size_t len, uint32_t group)
+{
+	uint32_t *old;
+	const char *key, *k;
+	size_t oldsize, keylen, klen, mask, i, j;
+
+	/* keep the load factor below one half, so probe sequences are short */
+	if (2 * (prompt->nuniq + 1) > prompt->uniqsize) {
+		old = prompt->uniq;
+		oldsize = prompt->uniqsize;
+		prompt->uniqsize = oldsize ? oldsize * 2 : 1024;
+		prompt->uniq = ecalloc(prompt->uniqsize, sizeof(*prompt->uniq));
+		mask = prompt->uniqsize - 1;
+		for (i = 0; i < oldsize; i++) {
+			if (old[i] == 0)
+				continue;
+			for (j = hashitem(&prompt->items, old[i] - 1) & mask; prompt->uniq[j]; j = (j + 1) & mask)
+				;
+			prompt->uniq[j] = old[i];
+		}
+		free(old);
+	}
+	mask = prompt->uniqsize - 1;
+	key = itemkey(s, len, &keylen);
+	for (j = hashkey(key, keylen, group) & mask; prompt->uniq[j]; j = (j + 1) & mask) {
+		i = prompt->uniq[j] - 1;
+		if (itemgroup(&prompt->items, i) != group)
+			continue;
+		k = itemkey(itemtext(&prompt->items, i), prompt->items.len[i], &klen);
+		if (klen == keylen && memcmp(k, key, klen) == 0)
+			return 0;
+	}
+	prompt->uniq[j] = prompt->items.nitems + 1;
+	prompt->nuniq++;
+	return 1;
+}
+
+/* append the items and groups of src to those of dst, and free the ones of src */
+static void
+joinparse(struct Parse *dst, struct Parse *src)
+{
+	struct Run *run;
+	const char *text;
+	uint32_t *map;
+	size_t i;
+
+	mergearena(&dst->arena, &src->arena);
+	free(src->coder.prev);
+	dst->setgroup = src->setgroup;
+	if (dst->table.nitems == 0 && dst->table.ngroups == 0) {
+		freetable(&dst->table);
+		dst->table = src->table;
+		dst->group = src->group;
+		memset(&src->table, 0, sizeof(src->table));
+		return;
+	}
+
+	/* the items before the first group of a chunk belong to the last group of the previous one */
+	map = mergegroups(&dst->table, &src->table, dst->group);
+	run = src->table.runs;
+	for (i = 0; i < src->table.nitems; i++) {
+		text = nexttext(&src->table, i, &run);
+		additem(&dst->table, run->coded ? run->base : NULL, text, src->table.len[i], map[itemgroup(&src->table, i)]);
+	}
+	dst->group = map[src->group];
+	free(map);
+	freetable(&src->table);
+}
+
+/* append the items and groups of a batch to the items of the prompt; return the group of its last line */
+static uint32_t
+pushparse(struct Prompt *prompt, struct Parse *parse)
+{
+	struct Run *run;
+	const char *text;
+	uint32_t *map, group;
+	size_t len, i;
+
+	/* the items before the first group of the batch belong to the last group of the source */
+	map = mergegroups(&prompt->items, &parse->table, parse->source->group);
+	for (i = 0; i < parse->table.ngroups; i++)
+		if (prompt->items.groups[map[i + 1] - 1] != parse->table.groups[i])
+			prompt->arenadead += groupbytes(parse->table.groups[i]);
+	run = parse->table.runs;
+	for (i = 0; i < parse->table.nitems; i++) {
+		text = nexttext(&parse->table, i, &run);
+		group = map[itemgroup(&parse->table, i)];
+		if (uflag && !uniqitem(prompt, runtext(&parse->table, run, text), parse->table.len[i], group)) {
+			if (run->coded)
+				prompt->arenadead += codedsize(text, &len);
+			continue;
+		}
+		additem(&prompt->items, run->coded ? run->base : NULL, text, parse->table.len[i], group);
+	}
+	group = map[parse->group];
+	free(map);
+	return group;
+}
+
+/*
+ * move the groups and the front-coded lines of the items of the prompt
+ * into a new arena, if most of the arena is taken by the ones of items
+ * dropped as duplicates or reloaded, and by groups no item is in.
+ * The items keep their indices, so their matches are kept, but groups
+ * are numbered anew.
+ */
+static void
+compactitems(struct Prompt *prompt)
+{
+	struct Source *src;
+	struct Table old;
+	struct Arena arena;
+	struct Coder coder;
+	struct Run *run;
+	const char *text, *block;
+	uint32_t *map;
+	size_t live, len, mask, i, j;
+
+	/* the groups the items and the sources are in, and the lines of the items, are live */
+	map = ecalloc(prompt->items.ngroups + 1, sizeof(*map));
+	for (src = prompt->sources; src; src = src->next)
+		map[src->group] = 1;
+	live = 0;
+	run = prompt->items.runs;
+	for (i = 0; i < prompt->items.nitems; i++) {
+		text = nexttext(&prompt->items, i, &run);
+		map[itemgroup(&prompt->items, i)] = 1;
+		if (run->coded)
+			live += codedsize(text, &len);
+	}
+	for (i = 0; i < prompt->items.ngroups; i++)
+		if (map[i + 1])
+			live += groupbytes(prompt->items.groups[i]);
+	if (2 * live >= prompt->arena.total) {
+		prompt->arenadead = prompt->arena.total - MIN(live, prompt->arena.total);
+		free(map);
+		return;
+	}
+
+	old = prompt->items;
+	memset(&prompt->items, 0, sizeof(prompt->items));
+	memset(&arena, 0, sizeof(arena));
+	memset(&coder, 0, sizeof(coder));
+	map[0] = 0;
+	for (i = 0; i < old.ngroups; i++)
+		if (map[i + 1])
+			map[i + 1] = addgroup(&prompt->items, allocgroup(&arena, old.groups[i]->name, strlen(old.groups[i]->name)));
+	run = old.runs;
+	for (i = 0; i < old.nitems; i++) {
+		text = nexttext(&old, i, &run);
+		block = NULL;
+		if (run->coded) {
+			codedsize(text, &len);
+			text = encodeline(&coder, &arena, runtext(&old, run, text), len);
+			block = coder.block;
+		}
+		additem(&prompt->items, block, text, old.len[i], map[itemgroup(&old, i)]);
+		prompt->items.match[i] = old.match[i];
+	}
+	for (src = prompt->sources; src; src = src->next)
+		src->group = map[src->group];
+	free(coder.prev);
+	free(map);
+	freetable(&old);
+	freearena(&prompt->arena);
+	prompt->arena = arena;
+	prompt->arenadead = 0;
+
+	/* the unique items are hashed with their group */
+	if (prompt->uniq == NULL)
+		return;
+	memset(prompt->uniq, 0, prompt->uniqsize * sizeof(*prompt->uniq));
+	mask = prompt->uniqsize - 1;
+	for (i = 0; i < prompt->items.nitems; i++) {
+		for (j = hashitem(&prompt->items, i) & mask; prompt->uniq[j]; j = (j + 1) & mask)
+			;
+		prompt->uniq[j] = i + 1;
+	}
+	prompt->nuniq = prompt->items.nitems;
+}
+
+/* add the items and groups of a batch to the prompt, and match them; return whether any item was added */
+static int
+addparse(struct Prompt *prompt, struct Parse *parse)
+{
+	size_t n[ClassLast];
+	size_t first;
+	enum Class c;
+
+	first = prompt->items.nitems;
+	parse->source->group = pushparse(prompt, parse);
+	mergearena(&prompt->arena, &parse->arena);
+	if (2 * prompt->arenadead > prompt->arena.total)
+		compactitems(prompt);
+
+	/* the matching items are listed after the items of their class, so the positions after it move */
+	for (c = 0; c < ClassLast; c++)
+		n[c] = prompt->matches[c].n;
+	/* with -l, the items are matched after the ones not matched yet, and only as far as they are listed */
+	scanitems(prompt, listneed(prompt));
+	shiftmatches(prompt, n);
+	return prompt->items.nitems > first;
+}
+
+/* replace the items of the lines of a watched file that changed by the items of a batch */
+static void
+reloadparse(struct Prompt *prompt, struct Parse *parse)
+{
+	struct Table old;
+	struct Run *run;
+	size_t *pos[] = {&prompt->selitem, &prompt->matchlist, &prompt->hoveritem};
+	size_t id[LEN(pos)], newid[LEN(pos)];
+	enum Class class[LEN(pos)];
+	const char *text;
+	size_t at, last, first, off, i, j;
+
+	/* the items not matched yet, with -l, are matched first, as the matches of the kept items are kept */
+	scanitems(prompt, SIZE_MAX);
+
+	/* the items at the selected, first listed and hovered positions are found again after the reload */
+	for (j = 0; j < LEN(pos); j++) {
+		if (!matchitem(prompt, *pos[j], &class[j], &id[j]))
+			id[j] = NOITEM;
+		newid[j] = (id[j] != NOITEM && classtable(prompt, class[j]) == &prompt->fitems) ? id[j] : NOITEM;
+	}
+
+	/* the new items go after the last kept line before the ones that changed, or before the first one after them */
+	old = prompt->items;
+	last = first = NOITEM;
+	run = old.runs;
+	for (i = 0; parse->oldbuf != NULL && i < old.nitems; i++) {
+		text = nexttext(&old, i, &run);
+		if ((uintptr_t)text < (uintptr_t)parse->oldbuf ||
+		    (uintptr_t)text >= (uintptr_t)parse->oldbuf + parse->oldlen)
+			continue;
+		off = text - parse->oldbuf;
+		if (off < parse->prefix)
+			last = i;
+		else if (off >= parse->oldlen - parse->suffix && first == NOITEM)
+			first = i;
+	}
+	at = (last != NOITEM) ? last + 1 : (first != NOITEM) ? first : old.nitems;
+
+	/* the table is built anew: items of the kept lines are rebased, the others are removed */
+	memset(&prompt->items, 0, sizeof(prompt->items));
+	prompt->items.groups = old.groups;
+	prompt->items.ngroups = old.ngroups;
+	prompt->items.groupsize = old.groupsize;
+	prompt->items.names = old.names;
+	prompt->items.namesize = old.namesize;
+	old.groups = NULL;
+	old.names = NULL;
+	if (prompt->uniq != NULL)
+		memset(prompt->uniq, 0, prompt->uniqsize * sizeof(*prompt->uniq));
+	prompt->nuniq = 0;
+	run = old.runs;
+	for (i = 0; i <= old.nitems; i++) {
+		if (i == at)
+			pushparse(prompt, parse);
+		if (i == old.nitems)
+			break;
+		text = nexttext(&old, i, &run);
+		if (parse->oldbuf != NULL && (uintptr_t)text >= (uintptr_t)parse->oldbuf &&
+		    (uintptr_t)text < (uintptr_t)parse->oldbuf + parse->oldlen) {
+			off = text - parse->oldbuf;
+			if (off < parse->prefix)
+				text = parse->buf + off;
+			else if (off >= parse->oldlen - parse->suffix)
+				text = parse->buf + off + parse->len - parse->oldlen;
+			else
+				continue;
+		}
+		if (uflag && !uniqitem(prompt, runtext(&old, run, text), old.len[i], itemgroup(&old, i)))
+			continue;
+		for (j = 0; j < LEN(pos); j++)
+			if (id[j] == i && classtable(prompt, class[j]) == &prompt->items)
+				newid[j] = prompt->items.nitems;
+		additem(&prompt->items, run->coded ? run->base : NULL, text, old.len[i], itemgroup(&old, i));
+		prompt->items.match[prompt->items.nitems - 1] = old.match[i];
+	}
+	freetable(&old);
+	mergearena(&prompt->arena, &parse->arena);
+	prompt->itemgen++;
+
+	/* the lines replaced are not counted, so whether the arena is worth compacting is found out each time */
+	compactitems(prompt);
+
+	/* only the new items are matched against the input */
+	rematchitems(prompt);
+	prompt->scanned = prompt->items.nitems;
+	if (zflag)
+		rankmatches(prompt, NULL);
+	for (j = 0; j < LEN(pos); j++)
+		*pos[j] = (newid[j] != NOITEM) ? matchpos(prompt, class[j], newid[j]) : NOITEM;
+	if (prompt->matchlist == NOITEM)
+		prompt->matchlist = (prompt->selitem != NOITEM) ? prompt->selitem : 0;
+}
+
+/* add to batch the items from the lines of the source ending between from and to */
+static void
+parselines(struct Source *src, size_t from, size_t to, struct Parse *batch)
+{
+	batch->beg = src->buf + src->pos;
+	batch->end = src->buf + to;
+	parsebuf(batch, src->buf + from);
+	src->pos = batch->beg - src->buf;
+	src->setgroup = batch->setgroup;
+}
+
+/* split the source up to to into chunks, parse them in parallel and add their items to batch */
+static void
+parsechunks(struct Source *src, size_t to, struct Parse *batch)
+{
+	struct Parse *parse;
+	pthread_t *threads;
+	const char *beg, *end, *s;
+	size_t i, n;
+	int setgroup;
+
+	parse = ecalloc(nthreads, sizeof(*parse));
+	threads = ecalloc(nthreads, sizeof(*threads));
+	beg = src->buf + src->pos;
+	setgroup = src->setgroup;
+	for (n = 0; n < nthreads && beg < src->buf + to; n++) {
+		/* each chunk ends right after the first newline past its share of the input */
+		end = src->buf + src->pos + (to - src->pos) / nthreads * (n + 1);
+		if (n + 1 == nthreads || end >= src->buf + to ||
+		    (s = memchr(end, '\n', src->buf + to - end)) == NULL)
+			end = src->buf + to;
+		else
+			end = MAX(s + 1, beg);
+		initparse(&parse[n], src, beg, end, setgroup);
+
+		/* whether a chunk starts naming a group depends only on whether the line before it is empty */
+		setgroup = (end - src->buf >= 2 && end[-2] == '\n') || end - 1 == src->buf + src->pos;
+		beg = end;
+	}
+	for (i = 1; i < n; i++)
+		if (pthread_create(&threads[i], NULL, parsethread, &parse[i]) != 0)
+			threads[i] = pthread_self();
+	if (n > 0)
+		parsethread(&parse[0]);
+	for (i = 0; i < n; i++) {
+		if (i > 0 && pthread_equal(threads[i], pthread_self()))
+			parsethread(&parse[i]);
+		else if (i > 0)
+			pthread_join(threads[i], NULL);
+		joinparse(batch, &parse[i]);
+	}
+	if (n > 0) {
+		src->pos = parse[n - 1].beg - src->buf;
+		src->setgroup = batch->setgroup;
+	}
+	free(parse);
+	free(threads);
+}
+
+/* map a new chunk with room for size bytes to spool the source into, and move the partial line into it */
+static void
+spoolchunk(struct Source *src, size_t size)
 {
-	static char buf[INPUTSIZ];
-	static enum Ctrl prevoperation = CTRLNOTHING;
-	enum Ctrl operation;
+	struct Chunk *chunk;
+	char *buf;
+	size_t len;
+	off_t off;
+
+	/* with -P the items do not point into the input, so the chunk read into is reused */
+	len = src->len - src->pos;
+	if (Pflag && !src->map && src->size >= size) {
+		memmove(src->buf, src->buf + src->pos, len);
+		src->pos = 0;
+		src->len = len;
+		return;
+	}
+
+	/*
+	 * a chunk holding nothing but a partial line has no item pointing
+	 * into it, so it is grown instead, doubling its size so a long line
+	 * is not copied over and over; in the spool file, the chunk is the
+	 * last one, so it is mapped again larger and nothing is copied
+	 */
+	size = (size + SPOOLSIZ - 1) / SPOOLSIZ * SPOOLSIZ;
+	chunk = src->chunks;
+	if (!src->map && src->pos == 0 && chunk != NULL && chunk->buf == src->buf) {
+		size = MAX(size, 2 * chunk->size);
+		buf = MAP_FAILED;
+		if (chunk->off != -1 && chunk->off + (off_t)chunk->size == src->spoolsize &&
+		    ftruncate(src->spoolfd, chunk->off + size) != -1 &&
+		    (buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, src->spoolfd, chunk->off)) != MAP_FAILED) {
+			src->spoolsize = chunk->off + size;
+		} else {
+			if ((buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED)
+				err(1, "mmap");
+			memcpy(buf, src->buf, len);
+			if (chunk->off != -1 && chunk->off + (off_t)chunk->size == src->spoolsize)
+				src->spoolsize = chunk->off;
+			chunk->off = -1;
+		}
+		munmap(chunk->buf, chunk->size);
+		chunk->buf = buf;
+		chunk->size = size;
+		src->buf = buf;
+		src->len = len;
+		src->size = size;
+		return;
+	}
+
+	/* the chunk is backed by the spool file, so the kernel can page it out without swap */
+	buf = MAP_FAILED;
+	off = -1;
+	if (src->spoolfd != -1 && ftruncate(src->spoolfd, src->spoolsize + size) != -1) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, src->spoolfd, src->spoolsize);
+		if (buf != MAP_FAILED) {
+			off = src->spoolsize;
+			src->spoolsize += size;
+		}
+	}
+	if (buf == MAP_FAILED)
+		if ((buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED)
+			err(1, "mmap");
+	addchunk(src, buf, size, off);
+
+	if (len > 0)
+		memcpy(buf, src->buf + src->pos, len);
+	src->buf = buf;
+	src->pos = 0;
+	src->len = len;
+	src->size = size;
+	src->map = 0;
+}
+
+/* create a batch of items from what is available from the source */
+static void
+readsource(struct Source *src, struct Parse *batch)
+{
+	size_t from, to;
+	ssize_t n;
 	char *s;
-	int len;
-	int dir;
-	KeySym ksym;
-	Status status;
 
-	len = XmbLookupString(ic.xic, ev, buf, sizeof buf, &ksym, &status);
-	switch (status) {
-	default: /* XLookupNone, XBufferOverflow */
-		return Nop;
-	case XLookupChars:
-		goto insert;
-	case XLookupKeySym:
-	case XLookupBoth:
-		break;
+	initparse(batch, src, NULL, NULL, src->setgroup);
+	if (src->map) {
+		/* the file is mapped; parse up to the first line ending some bytes from here */
+		from = src->pos + ((nthreads > 1) ? nthreads * PARSESIZ : READSIZ);
+		to = src->len;
+		if (from < src->len && (s = memchr(src->buf + from, '\n', src->len - from)) != NULL)
+			to = s - src->buf + 1;
+		if (nthreads > 1 && to - src->pos > PARSESIZ)
+			parsechunks(src, to, batch);
+		else
+			parselines(src, src->pos, to, batch);
+		if (to < src->len)
+			return;
+		src->eof = 1;
+		if (src->pos == src->len)
+			return;
+
+		/* the last line is copied so it can be followed by a nul, like the others */
+		spoolchunk(src, src->len - src->pos + 1);
+	} else {
+		/* make room for a whole read after the partial line, plus the terminating nul */
+		if (src->size - src->len < READSIZ + 1)
+			spoolchunk(src, src->len - src->pos + READSIZ + 1);
+
+		/* this is the only place the thread can be cancelled while it waits */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		n = read(src->fd, src->buf + src->len, src->size - src->len - 1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				return;
+			warn("%s", src->name);
+			n = 0;
+		}
+		if (n == 0)
+			src->eof = 1;
+
+		/* only search the new bytes for newlines, the partial line has none */
+		from = src->len;
+		src->len += n;
+		parselines(src, from, src->len, batch);
+		if (!src->eof || src->pos == src->len)
+			return;
 	}
 
-	operation = getoperation(ksym, ev->state);
-	if (operation == INSERT && (iscntrl(*buf) || *buf == '\0'))
-		return Nop;
-	if (ISUNDO(operation) && ISEDITING(prevoperation))
-		addundo(prompt, 0);
-	if (ISEDITING(operation) && operation != prevoperation)
-		addundo(prompt, 1);
-	prevoperation = operation;
-	switch (operation) {
-	case CTRLPASTE:
-		XConvertSelection(dpy, atoms[Clipboard], atoms[Utf8String], atoms[Utf8String], prompt->win, CurrentTime);
-		return Nop;
-	case CTRLCOPY:
-		XSetSelectionOwner(dpy, atoms[Clipboard], prompt->win, CurrentTime);
-		return Nop;
-	case CTRLCANCEL:
-		return Esc;
-	case CTRLENTER:
-		print(prompt);
-		return Enter;
-	case CTRLPREV:
-		/* FALLTHROUGH */
-	case CTRLNEXT:
-		if (!prompt->matchlist) {
-			getmatchlist(prompt);
-			navmatchlist(prompt, 0);
-		} else if (operation == CTRLNEXT) {
-			navmatchlist(prompt, 1);
-		} else if (operation == CTRLPREV) {
-			navmatchlist(prompt, -1);
+	/* the last line may not be terminated by a newline */
+	src->buf[src->len] = '\0';
+	parseline(batch, src->buf + src->pos, src->len - src->pos);
+	src->setgroup = batch->setgroup;
+	src->pos = src->len;
+}
+
+/* hand a batch to the event loop */
+static void
+queuebatch(struct Parse *batch)
+{
+	pthread_mutex_lock(&batchlock);
+	if (batchtail != NULL)
+		batchtail->next = batch;
+	else
+		batchhead = batch;
+	batchtail = batch;
+	pthread_mutex_unlock(&batchlock);
+
+	/* if the pipe is full, the event loop has yet to be woken up by a previous write anyway */
+	(void)write(batchpipe[1], "", 1);
+}
+
+/* read into *n the number written by putvarint() at *p, and move *p past it; return 0 if it does not end before end */
+static int
+checkvarint(const char **p, const char *end, size_t *n)
+{
+	const char *s;
+
+	for (s = *p; s < end && s - *p < VARINTSIZ; s++) {
+		if (!(*(const unsigned char *)s & 0x80)) {
+			*p = getvarint(*p, n);
+			return 1;
 		}
-		break;
-	case CTRLPGUP:
-	case CTRLPGDOWN:
-		/* TODO */
-		return Nop;
-	case CTRLSELBOL:
-	case CTRLBOL:
-		prompt->cursor = 0;
-		break;
-	case CTRLSELEOL:
-	case CTRLEOL:
-		if (prompt->text[prompt->cursor] != '\0')
-			prompt->cursor = strlen(prompt->text);
-		break;
-	case CTRLUP:
-		/* FALLTHROUGH */
-	case CTRLDOWN:
-		dir = (operation == CTRLUP) ? -1 : +1;
-		if (prompt->histsize == 0)
-			return Nop;
-		s = navhist(prompt, dir);
-		if (s) {
-			insert(prompt, NULL, 0 - prompt->cursor);
-			insert(prompt, s, strlen(s));
+	}
+	return 0;
+}
+
+/*
+ * check that the front-coded lines of a block of size bytes, read from
+ * an image, decode within it up to the lines of its n items, whose
+ * offsets are at off and whose lengths are at len: each item is a line
+ * of the block, after the one before it, and its text fits in the line
+ */
+static int
+checkblock(const char *block, size_t size, const uint32_t *off, const uint32_t *len, size_t n)
+{
+	const char *line, *next, *p, *end;
+	size_t prevlen, shared, rest, i;
+
+	if (size < FILTERSIZ)
+		return 0;
+	end = block + size;
+	next = block + FILTERSIZ;
+	prevlen = 0;
+	for (i = 0; i < n; i++) {
+		/* the lines are decoded in order up to the one of the item, as decodeline() does */
+		do {
+			if ((size_t)(next - block) > off[i])
+				return 0;
+			line = p = next;
+			if (!checkvarint(&p, end, &shared) || !checkvarint(&p, end, &rest) ||
+			    shared > prevlen || rest > (size_t)(end - p))
+				return 0;
+			prevlen = shared + rest;
+			next = p + rest;
+		} while (line != block + off[i]);
+		if (len[i] > prevlen)
+			return 0;
+	}
+	return 1;
+}
+
+/* get a section of size bytes of the image of a source at *pos, and move *pos past it; return NULL if the image is too short */
+static const char *
+cachesection(struct Source *src, size_t *pos, uint64_t size)
+{
+	const char *p;
+
+	if (size > src->imagesize || CACHEALIGN(size) > src->imagesize - *pos)
+		return NULL;
+	p = src->image + *pos;
+	*pos += CACHEALIGN(size);
+	return p;
+}
+
+/* go through the batches of the image of a source, queuing them if queue is set; return 0 if the image is corrupt */
+static int
+readcache(struct Source *src, int queue)
+{
+	struct CacheBatch cb;
+	const struct CacheRun *runs;
+	const uint32_t *off, *len, *group;
+	const char *names, *data, *base, *s;
+	struct Parse *batch;
+	uint32_t *map;
+	size_t pos, next, size, i, j;
+
+	pos = sizeof(struct CacheHeader);
+	while (pos < src->imagesize) {
+		if ((s = cachesection(src, &pos, sizeof(cb))) == NULL)
+			return 0;
+		memcpy(&cb, s, sizeof(cb));
+		if (cb.nitems > src->imagesize || cb.nruns > src->imagesize || cb.ngroups > src->imagesize ||
+		    (runs = (const void *)cachesection(src, &pos, cb.nruns * sizeof(*runs))) == NULL ||
+		    (off = (const void *)cachesection(src, &pos, cb.nitems * sizeof(*off))) == NULL ||
+		    (len = (const void *)cachesection(src, &pos, cb.nitems * sizeof(*len))) == NULL ||
+		    (group = (const void *)cachesection(src, &pos, cb.nitems * sizeof(*group))) == NULL ||
+		    (names = cachesection(src, &pos, cb.namelen)) == NULL ||
+		    (data = cachesection(src, &pos, cb.datalen)) == NULL)
+			return 0;
+
+		/* the image is checked whole before any of it is queued, as it cannot be taken back */
+		if (!queue) {
+			if (cb.group > cb.ngroups || (cb.nitems > 0 && (cb.nruns == 0 || runs[0].first != 0)))
+				return 0;
+			for (s = names, i = 0; i < cb.ngroups; i++, s++)
+				if ((s = memchr(s, '\0', names + cb.namelen - s)) == NULL)
+					return 0;
+			for (j = 0; j < cb.nruns; j++) {
+				next = (j + 1 < cb.nruns) ? runs[j + 1].first : cb.nitems;
+				size = runs[j].inimage ? cb.datalen : src->cachehdr.size;
+				if (next < runs[j].first || next > cb.nitems || runs[j].base > size)
+					return 0;
+				size -= runs[j].base;
+				for (i = runs[j].first; i < next; i++)
+					if (off[i] >= size || (!runs[j].coded && len[i] >= size - off[i]) || group[i] > cb.ngroups)
+						return 0;
+
+				/* the lines of a front-coded run are decoded from the beginning of its block */
+				base = runs[j].inimage ? data + runs[j].base : src->file + runs[j].base;
+				if (runs[j].coded && !checkblock(base, size, off + runs[j].first, len + runs[j].first, next - runs[j].first))
+					return 0;
+			}
+			continue;
 		}
-		break;
-	case CTRLSELLEFT:
-	case CTRLLEFT:
-		if (prompt->cursor > 0)
-			prompt->cursor = nextrune(prompt->text, prompt->cursor, -1);
-		else
-			return Nop;
-		break;
-	case CTRLSELRIGHT:
-	case CTRLRIGHT:
-		if (prompt->text[prompt->cursor] != '\0')
-			prompt->cursor = nextrune(prompt->text, prompt->cursor, +1);
-		else
-			return Nop;
-		break;
-	case CTRLSELWLEFT:
-	case CTRLWLEFT:
-		prompt->cursor = movewordedge(prompt->text, prompt->cursor, -1);
-		break;
-	case CTRLSELWRIGHT:
-	case CTRLWRIGHT:
-		prompt->cursor = movewordedge(prompt->text, prompt->cursor, +1);
-		break;
-	case CTRLDELBOL:
-		insert(prompt, NULL, 0 - prompt->cursor);
-		break;
-	case CTRLDELEOL:
-		prompt->text[prompt->cursor] = '\0';
-		break;
-	case CTRLDELRIGHT:
-	case CTRLDELLEFT:
-		if (prompt->cursor != prompt->select) {
-			delselection(prompt);
-			break;
+
+		batch = emalloc(sizeof(*batch));
+		initparse(batch, src, NULL, NULL, 0);
+		map = emalloc((cb.ngroups + 1) * sizeof(*map));
+		map[0] = 0;
+		for (s = names, i = 0; i < cb.ngroups; i++, s += strlen(s) + 1)
+			map[i + 1] = interngroup(&batch->table, &batch->arena, s, strlen(s));
+		for (j = 0; j < cb.nruns; j++) {
+			base = runs[j].inimage ? data + runs[j].base : src->file + runs[j].base;
+			next = (j + 1 < cb.nruns) ? runs[j + 1].first : cb.nitems;
+			for (i = runs[j].first; i < next; i++)
+				additem(&batch->table, runs[j].coded ? base : NULL, base + off[i], len[i], map[group[i]]);
 		}
-		if (operation == CTRLDELRIGHT) {
-			if (prompt->text[prompt->cursor] == '\0')
-				return Nop;
-			prompt->cursor = nextrune(prompt->text, prompt->cursor, +1);
+		batch->group = map[cb.group];
+		free(map);
+		queuebatch(batch);
+	}
+	return 1;
+}
+
+/* map the image of the items of a source if it was written for the file as it is, or start writing one */
+static void
+opencache(struct Source *src)
+{
+	struct CacheHeader hdr;
+	struct stat sb;
+	char *image;
+	int fd;
+
+	if ((fd = open(cachefile, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (fstat(fd, &sb) != -1 && (uintmax_t)sb.st_size >= sizeof(src->cachehdr) &&
+		    (uintmax_t)sb.st_size <= SIZE_MAX &&
+		    (image = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+			src->image = image;
+			src->imagesize = sb.st_size;
+			if (memcmp(image, &src->cachehdr, sizeof(src->cachehdr)) == 0 && readcache(src, 0)) {
+				close(fd);
+				return;
+			}
+			munmap(image, sb.st_size);
+			src->image = NULL;
 		}
-		if (prompt->cursor == 0)
-			return Nop;
-		insert(prompt, NULL, nextrune(prompt->text, prompt->cursor, -1) - prompt->cursor);
-		break;
-	case CTRLDELWORD:
-		delword(prompt);
-		break;
-	case CTRLUNDO:
-		undo(prompt);
-		break;
-	case CTRLREDO:
-		redo(prompt);
-		break;
-	case CTRLNOTHING:
-		return Nop;
-	case INSERT:
-insert:
-		operation = INSERT;
-		if (iscntrl(*buf) || *buf == '\0')
-			return Nop;
-		if (*buf == '/' && fflag) {
-			cleanitem(prompt->fhead);
-			getfilelist(prompt);
+		close(fd);
+	}
+
+	/* the image is written under another name and renamed when complete, so it is never read half written */
+	src->cachetmp = emalloc(strlen(cachefile) + sizeof(".XXXXXX"));
+	sprintf(src->cachetmp, "%s.XXXXXX", cachefile);
+	if ((fd = mkostemp(src->cachetmp, O_CLOEXEC)) == -1 || (src->cachefp = fdopen(fd, "w")) == NULL) {
+		warn("%s", cachefile);
+		if (fd != -1) {
+			close(fd);
+			unlink(src->cachetmp);
 		}
-		delselection(prompt);
-		insert(prompt, buf, len);
-		break;
+		free(src->cachetmp);
+		src->cachetmp = NULL;
+		return;
+	}
+	hdr = src->cachehdr;
+	memset(hdr.magic, 0, sizeof(hdr.magic));
+	fwrite(&hdr, 1, sizeof(hdr), src->cachefp);
+}
+
+/* write the bytes at p into the image being written, padded to 8 bytes */
+static void
+cachewrite(struct Source *src, const void *p, size_t size)
+{
+	static const char pad[8];
+
+	fwrite(p, 1, size, src->cachefp);
+	fwrite(pad, 1, CACHEALIGN(size) - size, src->cachefp);
+}
+
+/* append a batch of items of a source to the image being written */
+static void
+cachebatch(struct Source *src, struct Parse *batch)
+{
+	static const char pad[8];
+	struct Table *table;
+	struct CacheBatch cb;
+	struct CacheRun *runs;
+	uint32_t group;
+	const char *s;
+	size_t *used, next, n, i, j;
+
+	table = &batch->table;
+	runs = ecalloc(table->nruns, sizeof(*runs));
+	used = ecalloc(table->nruns, sizeof(*used));
+	memset(&cb, 0, sizeof(cb));
+	cb.nitems = table->nitems;
+	cb.nruns = table->nruns;
+	cb.ngroups = table->ngroups;
+	cb.group = batch->group;
+	for (i = 0; i < table->ngroups; i++)
+		cb.namelen += strlen(table->groups[i]->name) + 1;
+
+	/* the text of the items is in the file, except for the front-coded lines and a last line with no newline */
+	for (j = 0; j < table->nruns; j++) {
+		runs[j].first = table->runs[j].first;
+		runs[j].coded = table->runs[j].coded;
+		s = table->runs[j].base;
+		if (!runs[j].coded && (uintptr_t)s >= (uintptr_t)src->file &&
+		    (uintptr_t)s < (uintptr_t)src->file + src->cachehdr.size) {
+			runs[j].base = s - src->file;
+			continue;
+		}
+
+		/* the lines of the run are copied up to the end of its last item */
+		next = (j + 1 < table->nruns) ? table->runs[j + 1].first : table->nitems;
+		s += table->off[next - 1];
+		if (runs[j].coded) {
+			s = getvarint(s, &n);
+			s = getvarint(s, &n);
+			s += n;
+			used[j] = s - table->runs[j].base;
+		} else {
+			s += table->len[next - 1];
+			used[j] = s + strcspn(s, "\n") - table->runs[j].base + 1;
+		}
+		runs[j].inimage = 1;
+		runs[j].base = cb.datalen;
+		cb.datalen += used[j];
+	}
+
+	cachewrite(src, &cb, sizeof(cb));
+	cachewrite(src, runs, table->nruns * sizeof(*runs));
+	cachewrite(src, table->off, table->nitems * sizeof(*table->off));
+	cachewrite(src, table->len, table->nitems * sizeof(*table->len));
+	for (i = 0; i < table->nitems; i++) {
+		group = itemgroup(table, i);
+		fwrite(&group, 1, sizeof(group), src->cachefp);
+	}
+	fwrite(pad, 1, CACHEALIGN(table->nitems * sizeof(group)) - table->nitems * sizeof(group), src->cachefp);
+	for (i = 0; i < table->ngroups; i++)
+		fwrite(table->groups[i]->name, 1, strlen(table->groups[i]->name) + 1, src->cachefp);
+	fwrite(pad, 1, CACHEALIGN(cb.namelen) - cb.namelen, src->cachefp);
+	for (j = 0; j < table->nruns; j++) {
+		if (!runs[j].inimage)
+			continue;
+		if (runs[j].coded) {
+			fwrite(table->runs[j].base, 1, used[j], src->cachefp);
+		} else {
+			/* the last line is followed by a nul in the image, as in the spool */
+			fwrite(table->runs[j].base, 1, used[j] - 1, src->cachefp);
+			fwrite(pad, 1, 1, src->cachefp);
+		}
+	}
+	fwrite(pad, 1, CACHEALIGN(cb.datalen) - cb.datalen, src->cachefp);
+	free(runs);
+	free(used);
+}
+
+/* complete the image being written and put it in place of the one in the cache file */
+static void
+closecache(struct Source *src)
+{
+	int ok;
+
+	ok = fflush(src->cachefp) != EOF && !ferror(src->cachefp) &&
+	     fseek(src->cachefp, 0, SEEK_SET) != -1 &&
+	     fwrite(src->cachehdr.magic, 1, sizeof(src->cachehdr.magic), src->cachefp) == sizeof(src->cachehdr.magic);
+	if (fclose(src->cachefp) == EOF)
+		ok = 0;
+	if (!ok || rename(src->cachetmp, cachefile) == -1) {
+		warn("%s", cachefile);
+		unlink(src->cachetmp);
+	}
+	src->cachefp = NULL;
+	free(src->cachetmp);
+	src->cachetmp = NULL;
+}
+
+/* check whether a line of a watched file starts at pos, and a group too with -g */
+static int
+islinestart(const char *buf, size_t pos)
+{
+	if (pos == 0)
+		return 1;
+	if (buf[pos - 1] != '\n')
+		return 0;
+	return !gflag || pos == 1 || buf[pos - 2] == '\n';
+}
+
+/* read a watched file anew, and queue a batch replacing the lines that changed */
+static void
+loadsource(struct Source *src)
+{
+	struct Parse *batch;
+	struct stat sb;
+	size_t len, prefix, suffix, end;
+	ssize_t n;
+	char *buf;
+	int fd;
+
+	if ((fd = open(src->name, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || (uintmax_t)sb.st_size >= SIZE_MAX) {
+		close(fd);
+		return;
+	}
+	buf = emalloc(sb.st_size + 1);
+	for (len = 0; len < (size_t)sb.st_size; len += n) {
+		if ((n = read(fd, buf + len, sb.st_size - len)) == -1 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+	close(fd);
+	buf[len] = '\0';
+	if (src->buf != NULL && len == src->len && memcmp(buf, src->buf, len) == 0) {
+		free(buf);
+		return;
 	}
 
-	if (ISMOTION(operation)) {          /* moving cursor while selecting */
-		prompt->select = prompt->cursor;
-		return DrawPrompt;
+	/* the lines in the common prefix and suffix of both contents are kept */
+	for (prefix = 0; prefix < len && prefix < src->len && buf[prefix] == src->buf[prefix]; prefix++)
+		;
+	while (!islinestart(src->buf, prefix))
+		prefix--;
+	end = MIN(len, src->len) - prefix;
+	for (suffix = 0; suffix < end && buf[len - suffix - 1] == src->buf[src->len - suffix - 1]; suffix++)
+		;
+	while (suffix > 0 && !(islinestart(buf, len - suffix) && islinestart(src->buf, src->len - suffix)))
+		suffix--;
+
+	batch = emalloc(sizeof(*batch));
+	initparse(batch, src, NULL, NULL, 1);
+	batch->reload = 1;
+	batch->buf = buf;
+	batch->len = len;
+	batch->oldbuf = src->buf;
+	batch->oldlen = src->len;
+	batch->prefix = prefix;
+	batch->suffix = suffix;
+
+	/* only the lines between the prefix and the suffix are parsed */
+	src->buf = buf;
+	src->pos = prefix;
+	src->len = src->size = len;
+	src->setgroup = 1;
+	end = len - suffix;
+	if (nthreads > 1 && end - prefix > PARSESIZ)
+		parsechunks(src, end, batch);
+	else
+		parselines(src, prefix, end, batch);
+	if (src->pos < end)
+		parseline(batch, buf + src->pos, end - src->pos);
+	queuebatch(batch);
+}
+
+#ifdef __linux__
+/* reload a watched file whenever it changes */
+static void
+watchsource(struct Source *src)
+{
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *dir;
+	char *path, *base, *p;
+	ssize_t n;
+	int changed, ret;
+
+	/* the directory is watched, as files are often replaced by renaming another one over them */
+	path = estrdup(src->name);
+	if ((base = strrchr(path, '/')) != NULL) {
+		*base++ = '\0';
+		dir = (*path != '\0') ? path : "/";
+	} else {
+		base = path;
+		dir = ".";
 	}
-	if (ISSELECTION(operation)) {       /* moving cursor while selecting */
-		XSetSelectionOwner(dpy, XA_PRIMARY, prompt->win, CurrentTime);
-		return DrawInput;
+	if ((src->wfd = inotify_init1(IN_CLOEXEC)) == -1 ||
+	    inotify_add_watch(src->wfd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO) == -1) {
+		warn("%s", src->name);
+		goto done;
 	}
-	if (ISEDITING(operation) || ISUNDO(operation)) {
-		if (fflag && operation != INSERT) {
-			cleanitem(prompt->fhead);
-			getfilelist(prompt);
-		}
-		getmatchlist(prompt);
-		navmatchlist(prompt, 0);
-		return DrawPrompt;
+	pfd.fd = src->wfd;
+	pfd.events = POLLIN;
+	for (;;) {
+		/* changes are coalesced until the file is left alone for a while */
+		changed = 0;
+		do {
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			ret = poll(&pfd, 1, changed ? WATCHDELAY : -1);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if (ret == -1 && errno != EINTR) {
+				warn("poll");
+				goto done;
+			}
+			if (ret <= 0 || (n = read(src->wfd, buf, sizeof(buf))) <= 0)
+				continue;
+			for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+				ev = (struct inotify_event *)p;
+				if (ev->mask & IN_Q_OVERFLOW || (ev->len > 0 && strcmp(ev->name, base) == 0))
+					changed = 1;
+			}
+		} while (ret != 0 || !changed);
+		loadsource(src);
 	}
-	return DrawPrompt;
+done:
+	free(path);
 }
+#endif
 
-/* get the position, in characters, of the cursor given a x position */
-static size_t
-getcurpos(struct Prompt *prompt, int x)
+/* read items from a source and queue them for the event loop, batch by batch */
+static void *
+sourcethread(void *arg)
 {
-	const char *s = prompt->text;
-	int w;
-	size_t len = 0;
-	const char *next;
-	int textwidth;
-
-	w = dc.pad;
-	while (*s) {
-		if (x < w)
-			break;
-		(void)getnextutf8char(s, &next);
-		len = strlen(prompt->text) - strlen(++s);
-		textwidth = drawtext(NULL, NULL, 0, 0, 0, prompt->text, len);
-		w = dc.pad + textwidth;
-		s = next;
+	struct Source *src;
+	struct Parse parse, *batch;
+
+	src = (struct Source *)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (src->watch) {
+		loadsource(src);
+#ifdef __linux__
+		watchsource(src);
+#endif
+		return NULL;
 	}
 
-	/* the loop returns len 1 char to the right */
-	if (len && x + 3 < w)   /* 3 pixel tolerance */
-		len--;
+	/* with -c, the items are read from the image of the file if there is one for it */
+	if (src->cache) {
+		opencache(src);
+		if (src->image != NULL) {
+			readcache(src, 1);
+			src->pos = src->len;
+			src->eof = 1;
+		}
+	}
+	while (!src->eof) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* the thread may be cancelled while reading, so the batch is only allocated once something was read into it */
+		readsource(src, &parse);
+		if (parse.table.nitems == 0 && parse.table.ngroups == 0)
+			continue;
+		batch = emalloc(sizeof(*batch));
+		*batch = parse;
+		if (src->cachefp != NULL)
+			cachebatch(src, batch);
+		queuebatch(batch);
+	}
+	if (src->cachefp != NULL)
+		closecache(src);
 
-	return len;
+	/* with -P the items were copied out of the input, which is not needed anymore */
+	if (Pflag)
+		freechunks(src);
+	return NULL;
 }
 
-/* get item on a given y position */
-static struct Item *
-getitem(struct Prompt *prompt, int y)
+/* start the thread reading a source */
+static void
+startsource(struct Source *src)
 {
-	struct Item *item;
-	size_t i, n;
+	if ((errno = pthread_create(&src->thread, NULL, sourcethread, src)) != 0)
+		err(1, "pthread_create");
+	src->running = 1;
+}
 
-	y -= prompt->h + prompt->separator;
-	y = MAX(y, 0);
-	n = y / prompt->h;
-	if (n > prompt->nitems)
-		return NULL;
-	for (i = 0, item = prompt->matchlist;
-	     i < n && item->nextmatch;
-	     i++, item = item->nextmatch)
-		;
+/* start a thread for each source */
+static void
+startsources(struct Prompt *prompt)
+{
+	struct Source *src;
+	int flags, i;
+
+	if (pipe(batchpipe) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl(batchpipe[i], F_GETFL)) == -1 ||
+		    fcntl(batchpipe[i], F_SETFL, flags | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	for (src = prompt->sources; src; src = src->next)
+		startsource(src);
+}
 
-	return item;
+/* free a batch, and what was not added to the prompt of it */
+static void
+freebatch(struct Parse *batch)
+{
+	freetable(&batch->table);
+	freearena(&batch->arena);
+	free(batch->coder.prev);
+	free(batch->oldbuf);
+	free(batch);
 }
 
-/* handle button press */
-static enum Press_ret
-buttonpress(struct Prompt *prompt, XButtonEvent *ev)
+/* add the items queued by the source threads and match them; return 2 if a file was reloaded, 1 if items were only appended */
+static int
+addbatches(struct Prompt *prompt)
 {
-	static int word = 0;    /* whether a word was selected by double click */
-	static Time lasttime = 0;
-	size_t curpos;
+	struct Parse *batch, *next;
+	char buf[64];
+	int ret;
 
-	if (ic.composing)       /* we ignore mouse events when composing */
-		return Nop;
-	switch (ev->button) {
-	case Button2:                               /* middle click paste */
-		delselection(prompt);
-		XConvertSelection(dpy, XA_PRIMARY, atoms[Utf8String], atoms[Utf8String], prompt->win, CurrentTime);
-		return Nop;
-	case Button1:
-		if (ev->y < 0 || ev->x < 0)
-			return Nop;
-		if (ev->y <= prompt->h) {
-			curpos = getcurpos(prompt, ev->x);
-			if (word && ev->time - lasttime < DOUBLECLICK) {
-				prompt->cursor = 0;
-				if (prompt->text[prompt->cursor] != '\0')
-					prompt->select = strlen(prompt->text);
-				word = 0;
-			} else if (ev->time - lasttime < DOUBLECLICK) {
-				prompt->cursor = movewordedge(prompt->text, curpos, -1);
-				prompt->select = movewordedge(prompt->text, curpos, +1);
-				word = 1;
-			} else {
-				prompt->select = prompt->cursor = curpos;
-				word = 0;
-			}
-			lasttime = ev->time;
-			return DrawInput;
-		} else if (ev->y > prompt->h + prompt->separator) {
-			if ((prompt->selitem = getitem(prompt, ev->y)) == NULL)
-				return Nop;
-			print(prompt);
-			return Enter;
+	while (read(batchpipe[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&batchlock);
+	batch = batchhead;
+	batchhead = batchtail = NULL;
+	pthread_mutex_unlock(&batchlock);
+
+	/* batches are added in the order they were queued, so each source keeps its order */
+	ret = 0;
+	for (; batch; batch = next) {
+		next = batch->next;
+		if (batch->reload) {
+			reloadparse(prompt, batch);
+			ret = 2;
+		} else if (addparse(prompt, batch)) {
+			ret = MAX(ret, 1);
 		}
-		return Nop;
-	default:
-		return Nop;
+		freebatch(batch);
 	}
-
-	return Nop;
+	return ret;
 }
 
-/* handle button motion X event */
-static enum Press_ret
-buttonmotion(struct Prompt *prompt, XMotionEvent *ev)
+/* get a key for the item at position pos of the list of matching items, which does not change when items are appended */
+static uint64_t
+matchkey(struct Prompt *prompt, size_t pos)
 {
-	size_t prevselect, prevcursor;
+	enum Class class;
+	size_t i;
 
-	prevselect = prompt->select;
-	prevcursor = prompt->cursor;
+	if (!matchitem(prompt, pos, &class, &i))
+		return UINT64_MAX;
+	return (uint64_t)class << 32 | i;
+}
 
-	if (ic.composing)       /* we ignore mouse events when composing */
-		return Nop;
-	if (ev->y >= 0 && ev->y <= prompt->h)
-		prompt->select = getcurpos(prompt, ev->x);
-	else if (ev->y < 0)
-		prompt->select = 0;
-	else if (prompt->text[prompt->cursor] != '\0')
-		prompt->cursor = strlen(prompt->text);
-	else
-		return Nop;
+/* add the items queued by the source threads and redraw the prompt if the listed items changed */
+static void
+readbatches(struct Prompt *prompt)
+{
+	uint64_t first, last;
+	int full, ret;
 
-	/* if the selection didn't change there's no need to redraw input */
-	if (prompt->select == prevselect && prompt->cursor == prevcursor)
-		return Nop;
+	full = prompt->nitems > 0 && prompt->nitems == prompt->maxitems;
+	first = matchkey(prompt, prompt->matchlist);
+	last = full ? matchkey(prompt, prompt->matchlist + prompt->nitems - 1) : UINT64_MAX;
+	if ((ret = addbatches(prompt)) == 0)
+		return;
 
-	return DrawInput;
+	if (prompt->selitem == NOITEM)
+		prompt->matchlist = 0;
+	navmatchlist(prompt, 0);
+
+	/* new items were listed only if the listed range moved or was not full; reloads can change any of them */
+	if (ret == 2 || !full || first != matchkey(prompt, prompt->matchlist) ||
+	    last != matchkey(prompt, prompt->matchlist + prompt->nitems - 1))
+		drawprompt(prompt);
 }
 
-/* handle pointer motion X event */
-static enum Press_ret
-pointermotion(struct Prompt *prompt, XMotionEvent *ev)
+/* stop the source threads and free what they read but the items added to the prompt */
+static void
+stopsources(struct Prompt *prompt)
 {
-	static int intext = 0;
-	struct Item *prevhover;
-	int miny, maxy;
-
-	if (ev->y < prompt->h && !intext) {
-		XDefineCursor(dpy, prompt->win, cursor);
-		intext = 1;
-	} else if (ev->y >= prompt->h && intext) {
-		XUndefineCursor(dpy, prompt->win);
-		intext = 0;
+	struct Source *src;
+	struct Parse *batch;
+
+	while ((src = prompt->sources) != NULL) {
+		prompt->sources = src->next;
+		if (src->running) {
+			pthread_cancel(src->thread);
+			pthread_join(src->thread, NULL);
+		}
+		/* the command is waited for, so it is killed with a signal it cannot ignore */
+		if (src->pid > 0) {
+			kill(-src->pid, SIGKILL);
+			waitpid(src->pid, NULL, 0);
+		}
+		freechunks(src);
+		if (src->image != NULL)
+			munmap(src->image, src->imagesize);
+		if (src->cachefp != NULL) {
+			fclose(src->cachefp);
+			unlink(src->cachetmp);
+			free(src->cachetmp);
+		}
+		if (src->spoolfd != -1)
+			close(src->spoolfd);
+		if (src->fd != STDIN_FILENO)
+			close(src->fd);
+		if (src->wfd != -1)
+			close(src->wfd);
+		if (src->watch)
+			free(src->buf);
+		free(src);
 	}
-	if (ic.composing)       /* we ignore mouse events when composing */
-		return Nop;
-	miny = prompt->h + prompt->separator;
-	maxy = miny + prompt->h * prompt->nitems;
-	prevhover = prompt->hoveritem;
-	if (ev->y < miny || ev->y >= maxy)
-		prompt->hoveritem = NULL;
-	else
-		prompt->hoveritem = getitem(prompt, ev->y);
 
-	return (prevhover != prompt->hoveritem) ? DrawPrompt : Nop;
+	/* batches that were not added to the prompt */
+	pthread_mutex_lock(&batchlock);
+	batch = batchhead;
+	batchhead = batchtail = NULL;
+	pthread_mutex_unlock(&batchlock);
+	while (batch != NULL) {
+		batchhead = batch->next;
+		freebatch(batch);
+		batch = batchhead;
+	}
 }
 
-/* resize prompt */
-static enum Press_ret
-resize(struct Prompt *prompt, XConfigureEvent *ev)
+/* stop the source threads and free what they read */
+static void
+cleansources(struct Prompt *prompt)
 {
-	prompt->w = ev->width;
-	destroypix(prompt);
-	createpix(prompt);
-	return DrawPrompt;
+	stopsources(prompt);
+	free(prompt->query);
+	if (batchpipe[0] != -1) {
+		close(batchpipe[0]);
+		close(batchpipe[1]);
+	}
 }
 
-/* save history in history file */
+/* free the items read from the sources and their groups */
 static void
-savehist(struct Prompt *prompt)
+clearitems(struct Prompt *prompt)
 {
-	int diff;   /* whether the last history entry differs from prompt->text */
-	int fd;
-
-	if (prompt->histfp == NULL)
-		return;
-
-	fd = fileno(prompt->histfp);
-	ftruncate(fd, 0);
+	resetarena(&prompt->arena);
+	prompt->arenadead = 0;
+	cleartable(&prompt->items);
+	prompt->matches[ClassPrefix].n = prompt->matches[ClassMiddle].n = 0;
+	prompt->scanned = 0;
+	prompt->nranks = 0;
+	prompt->itemgen++;
+	if (prompt->uniq != NULL)
+		memset(prompt->uniq, 0, prompt->uniqsize * sizeof(*prompt->uniq));
+	prompt->nuniq = 0;
+	prompt->selitem = prompt->hoveritem = NOITEM;
+	prompt->matchlist = 0;
+}
 
-	if (!prompt->histsize) {
-		fprintf(prompt->histfp, "%s\n", prompt->text);
-		return;
+/* start the command with the input as its argument, and a source reading the items from it */
+static void
+startcommand(struct Prompt *prompt)
+{
+	struct Source *src;
+	pid_t pid;
+	int fd[2];
+
+	free(prompt->query);
+	prompt->query = estrdup(prompt->text);
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+		break;
+	case 0:
+		/* the command gets its own process group, so whatever it runs is killed with it */
+		setpgid(0, 0);
+		close(fd[0]);
+		close(batchpipe[0]);
+		close(batchpipe[1]);
+		if (listpipe[0] != -1) {
+			close(listpipe[0]);
+			close(listpipe[1]);
+		}
+		if (dpy != NULL)
+			close(ConnectionNumber(dpy));
+		if (fd[1] != STDOUT_FILENO) {
+			dup2(fd[1], STDOUT_FILENO);
+			close(fd[1]);
+		}
+		execl("/bin/sh", "sh", "-c", ecmd, "sh", prompt->query, (char *)NULL);
+		warn("/bin/sh");
+		_exit(127);
+		break;
 	}
+	setpgid(pid, pid);
+	close(fd[1]);
+	src = addsource(prompt, ecmd, fd[0]);
+	src->pid = pid;
+	startsource(src);
+}
 
-	diff = strcmp(prompt->history[prompt->histsize - 1], prompt->text);
-
-	prompt->histindex = (diff && prompt->histsize == config.histsize) ? 1 : 0;
-
-	while (prompt->histindex < prompt->histsize)
-		fprintf(prompt->histfp, "%s\n", prompt->history[prompt->histindex++]);
-
-	if (diff)
-		fprintf(prompt->histfp, "%s\n", prompt->text);
+/* read the items from the command run with the input as its argument, replacing the items read before */
+static void
+runcommand(struct Prompt *prompt)
+{
+	prompt->pending = 0;
+	stopsources(prompt);
+	clearitems(prompt);
+	startcommand(prompt);
+	getmatchlist(prompt, prompt->text);
+	navmatchlist(prompt, 0);
 }
 
-/* process X event; return 1 in case user exits */
+/* process X event and items read from the sources; return 1 in case user exits */
 static int
 run(struct Prompt *prompt)
 {
+	struct pollfd pfd[3];
+	struct timespec now;
 	enum Press_ret retval = Nop;
 	XEvent ev;
-
-	while (!XNextEvent(dpy, &ev)) {
+	int timeout, nready, idle;
+
+	pfd[0].fd = ConnectionNumber(dpy);
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = listpipe[0];
+	pfd[2].events = POLLIN;
+	for (;;) {
+		if (XPending(dpy) == 0) {
+			/* the items are not added to while the lister thread has them */
+			pfd[1].fd = prompt->matching ? -1 : batchpipe[0];
+			/* with -e, the command is run again once the input is left alone long enough */
+			timeout = -1;
+			if (prompt->pending) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				timeout = (prompt->rerun.tv_sec - now.tv_sec) * 1000 +
+				          (prompt->rerun.tv_nsec - now.tv_nsec) / 1000000;
+				if (timeout <= 0) {
+					waitmatches(prompt);
+					runcommand(prompt);
+					drawprompt(prompt);
+					continue;
+				}
+			}
+			/* with -l and -t, the items not matched or indexed yet are taken a step at a time while nothing else comes */
+			idle = !prompt->matching && (prompt->scanned < prompt->items.nitems ||
+			       (tflag && (nindexed(prompt) < prompt->items.nitems || prompt->index.carry != NULL)));
+			if (idle)
+				timeout = 0;
+			if ((nready = poll(pfd, LEN(pfd), timeout)) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "poll");
+			}
+			if (idle && nready == 0 && prompt->scanned < prompt->items.nitems)
+				scanstep(prompt);
+			else if (idle && nready == 0)
+				indexstep(prompt);
+			else if (pfd[2].revents & POLLIN)
+				readmatches(prompt);
+			else if (pfd[1].revents & POLLIN)
+				readbatches(prompt);
+			continue;
+		}
+		XNextEvent(dpy, &ev);
 		if (XFilterEvent(&ev, None))
 			continue;
 		retval = Nop;
@@ -2055,60 +6077,6 @@ run(struct Prompt *prompt)
 	return 0;
 }
 
-/* create completion items from the stdin */
-static void
-readstdin(struct Prompt *prompt)
-{
-	struct Item *item;
-	char buf[INPUTSIZ];
-	char *text, *description, *output, *s;
-	int setgroup;
-
-	setgroup = 1;
-	while (fgets(buf, sizeof buf, stdin) != NULL) {
-		/* discard empty lines */
-		if (*buf && *buf == '\n') {
-			setgroup = 1;
-			continue;
-		}
-
-		buf[strcspn(buf, "\n")] = '\0';
-
-		if (gflag && setgroup) {
-			prompt->groups = allocgroup(prompt->groups, buf);
-			setgroup = 0;
-			continue;
-		}
-
-		/* get the item text */
-		description = NULL;
-		output = NULL;
-		s = text = buf;
-		if (s && ((s = strchr(s, '\t')) != NULL)) {
-			*s = '\0';
-			description = ++s;
-		}
-		if (s && ((s = strchr(s, '\t')) != NULL)) {
-			*s = '\0';
-			output = ++s;
-		}
-
-		/* discard empty text entries */
-		if (!text || *text == '\0')
-			continue;
-
-		item = allocitem(text, description, output, prompt->groups);
-
-		if (prompt->head == NULL)
-			prompt->head = item;
-		if (prompt->tail != NULL)
-			prompt->tail->next = item;
-		item->prev = prompt->tail;
-		prompt->tail = item;
-	}
-	prompt->matchlist = prompt->head;
-}
-
 /* free history entries */
 static void
 cleanhist(struct Prompt *prompt)
@@ -2145,19 +6113,28 @@ cleanundo(struct Undo *undo)
 static void
 cleanprompt(struct Prompt *prompt)
 {
-	struct Group *group, *tmp;
-
-	group = prompt->groups;
-	while (group) {
-		tmp = group;
-		group = group->next;
-		free(tmp->name);
-		free(tmp);
-	}
-
-	cleanitem(prompt->head);
+	struct Memo *memo;
+	enum Class c;
+
+	cleansources(prompt);
+	freetable(&prompt->items);
+	freetable(&prompt->fitems);
+	for (c = 0; c < ClassLast; c++)
+		free(prompt->matches[c].items);
+	freearena(&prompt->arena);
+	freearena(&prompt->files);
+	free(prompt->uniq);
 	free(prompt->text);
-	free(prompt->itemarray);
+	free(prompt->matchtext);
+	free(prompt->posttext);
+	free(prompt->ranks);
+	clearindex(&prompt->index);
+	free(prompt->index.cands.items);
+	free(prompt->index.prefix.items);
+	while ((memo = prompt->memos) != NULL) {
+		prompt->memos = memo->next;
+		freememo(memo);
+	}
 
 	destroypix(prompt);
 	XDestroyWindow(dpy, prompt->win);
@@ -2200,36 +6177,103 @@ int
 main(int argc, char *argv[])
 {
 	struct Prompt prompt;
-	int ch;
+	int ch, i, nsources;
 	char *histfile;
+	char **sources;
 
 	histfile = NULL;
-	while ((ch = getopt(argc, argv, "fgh:ip")) != -1) {
+	nsources = 0;
+	sources = ecalloc(argc + 1, sizeof(*sources));
+	while ((ch = getopt(argc, argv, "c:e:fgGh:ilm:Pps:tuwz")) != -1) {
 		switch (ch) {
+		case 'c':
+			cachefile = optarg;
+			break;
+		case 'e':
+			ecmd = optarg;
+			break;
 		case 'f':
 			fflag = 1;
 			break;
 		case 'g':
 			gflag = 1;
 			break;
+		case 'G':
+			Gflag = 1;
+			break;
 		case 'h':
 			histfile = optarg;
 			break;
 		case 'i':
+			iflag = 1;
 			fstrncmp = strncasecmp;
 			break;
+		case 'l':
+			lflag = 1;
+			break;
+		case 'm':
+			if ((matchfields = parsefields(optarg)) == 0)
+				usage();
+			break;
+		case 'P':
+			Pflag = 1;
+			break;
 		case 'p':
 			pflag = 1;
 			break;
+		case 's':
+			sources[nsources++] = optarg;
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		case 'u':
+			uflag = 1;
+			break;
+		case 'w':
+			wflag = 1;
+			break;
+		case 'z':
+			zflag = 1;
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
+	/* subsequences are not looked up in the index, so it is not built */
+	if (zflag)
+		tflag = 0;
+
+	/* use as many threads as there are processors, unless configured otherwise */
+	if ((nthreads = config.nthreads) == 0) {
+		long n;
+
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (n > 0) ? n : 1;
+	}
+
+	initsearch();
+
+	/* read the sources while the X stuff is set up */
+	setpromptinput(&prompt);
+	setpromptitems(&prompt);
+	if (ecmd != NULL)
+		nsources = 0;
+	else if (nsources == 0)
+		sources[nsources++] = "-";
+	for (i = 0; i < nsources; i++)
+		opensource(&prompt, sources[i]);
+	free(sources);
+	startsources(&prompt);
+	if (ecmd != NULL)
+		startcommand(&prompt);
+
 	/* set locale and modifiers */
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		warnx("warning: no locale support");
+	initfilter();
 	if (!XSetLocaleModifiers(""))
 		warnx("warning: could not set locale modifiers");
 
@@ -2254,30 +6298,31 @@ main(int argc, char *argv[])
 	initcursor();
 
 	/* setup prompt */
-	setpromptinput(&prompt);
 	setpromptundo(&prompt);
-	setpromptitems(&prompt);
+	setpromptarray(&prompt);
 	setpromptgeom(&prompt);
 	setpromptwin(&prompt, argc, argv);
 	setpromptic(&prompt);
 	setpromptevents(&prompt);
 	setprompthist(&prompt, histfile);
 
-	/* read stdin and fill match list */
-	readstdin(&prompt);
+	/* fill match list with the items read so far; the others are added while the event loop runs */
 	if (fflag)
 		getfilelist(&prompt);
-	getmatchlist(&prompt);
+	addbatches(&prompt);
+	getmatchlist(&prompt, prompt.text);
 	navmatchlist(&prompt, 0);
 
 	/* run event loop */
 	XMapRaised(dpy, prompt.win);
 	createpix(&prompt);
+	startlister(&prompt);
 	run(&prompt);
 
 	/* freeing stuff */
 	cleanhist(&prompt);
 	cleanundo(prompt.undo);
+	cleanmatchers();
 	cleanprompt(&prompt);
 	cleandc();
 	cleanic();